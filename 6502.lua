@@ -15,56 +15,57 @@ local op_eval_word = function(late, early) return word_normalize(op_eval(late, e
 M.op_eval_word = op_eval_word
 
 local cycles_def,xcross_def
+local op = function(code, cycles, xcross) return M.op(code, cycles or cycles_def, xcross or xcross_def) end
 
 cycles_def=2 xcross_def=0 local opimp={
-    asl=M.op(0x0a), brk=M.op(0x00,7), clc=M.op(0x18), cld=M.op(0xd8), cli=M.op(0x58), clv=M.op(0xb8), dex=M.op(0xca), dey=M.op(0x88),
-    inx=M.op(0xe8), iny=M.op(0xc8), lsr=M.op(0x4a), nop=M.op(0xea), pha=M.op(0x48,3), php=M.op(0x08,3), pla=M.op(0x68,4), plp=M.op(0x28,4),
-    rol=M.op(0x2a), ror=M.op(0x6a), rti=M.op(0x40,6), rts=M.op(0x60,6), sec=M.op(0x38), sei=M.op(0x78), tax=M.op(0xaa), tay=M.op(0xa8),
-    tsx=M.op(0xba), txa=M.op(0x8a), txs=M.op(0x9a), tya=M.op(0x98),
-    jam=M.op(0x02,0),
+    asl=op(0x0a), brk=op(0x00,7), clc=op(0x18), cld=op(0xd8), cli=op(0x58), clv=op(0xb8), dex=op(0xca), dey=op(0x88),
+    inx=op(0xe8), iny=op(0xc8), lsr=op(0x4a), nop=op(0xea), pha=op(0x48,3), php=op(0x08,3), pla=op(0x68,4), plp=op(0x28,4),
+    rol=op(0x2a), ror=op(0x6a), rti=op(0x40,6), rts=op(0x60,6), sec=op(0x38), sed=op(0xf8), sei=op(0x78), tax=op(0xaa), tay=op(0xa8),
+    tsx=op(0xba), txa=op(0x8a), txs=op(0x9a), tya=op(0x98),
+    jam=op(0x02,0),
 } M.opimp = opimp
 for k,v in pairs(opimp) do
     M[k .. 'imp'] = function()
-        table.insert(M.section_current.instructions, { size=1, cycles=v.cycles, bin=v.opc })
+        table.insert(M.section_current.instructions, { op=k, mode='imp', size=1, cycles=v.cycles, bin=v.opc })
     end
 end
 
 cycles_def=2 xcross_def=0 local opimm={
-    adc=M.op(0x69), ['and']=M.op(0x29), cmp=M.op(0xc9), cpx=M.op(0xe0), cpy=M.op(0xc0), eor=M.op(0x49), lda=M.op(0xa9), ldx=M.op(0xa2),
-    ldy=M.op(0xa0), ora=M.op(0x09), sbc=M.op(0xe9),
-    anc=M.op(0x0b), ane=M.op(0x8b), arr=M.op(0x6b), asr=M.op(0x4b), jam=M.op(0x12,0), lax=M.op(0xab), nop=M.op(0x80), sbx=M.op(0xcb),
+    adc=op(0x69), ['and']=op(0x29), cmp=op(0xc9), cpx=op(0xe0), cpy=op(0xc0), eor=op(0x49), lda=op(0xa9), ldx=op(0xa2),
+    ldy=op(0xa0), ora=op(0x09), sbc=op(0xe9),
+    anc=op(0x0b), ane=op(0x8b), arr=op(0x6b), asr=op(0x4b), jam=op(0x12,0), lax=op(0xab), nop=op(0x80), sbx=op(0xcb),
 } M.opimm = opimm
 for k,v in pairs(opimm) do
     M[k .. 'imm'] = function(late, early)
         local l65dbg = { info=debug.getinfo(2, 'Sl'), trace=debug.traceback(nil, 1) }
         local size = function() late,early = M.size_op(late,early) return 2 end
         local bin = function() local l65dbg=l65dbg return { v.opc, M.op_eval_byte(late,early,true) } end
-        table.insert(M.section_current.instructions, { size=size, cycles=2, bin=bin })
+        table.insert(M.section_current.instructions, { op=k, mode='imm', late=late, early=early, size=size, cycles=2, bin=bin })
     end
 end
 
 cycles_def=3 xcross_def=0 local opzpg={
-    adc=M.op(0x65), ['and']=M.op(0x25), asl=M.op(0x06,5), bit=M.op(0x24), cmp=M.op(0xc5), cpx=M.op(0xe4), cpy=M.op(0xc4), dec=M.op(0xc6,5),
-    eor=M.op(0x45), inc=M.op(0xe6,5), lda=M.op(0xa5), ldx=M.op(0xa6), ldy=M.op(0xa4), lsr=M.op(0x46,5), ora=M.op(0x05), rol=M.op(0x26,5),
-    ror=M.op(0x66,5), sbc=M.op(0xe5), sta=M.op(0x85), stx=M.op(0x86), sty=M.op(0x84), 
-    dcp=M.op(0xc7,5), isb=M.op(0xe7,5), jam=M.op(0x22,0), lax=M.op(0xa7), nop=M.op(0x04), rla=M.op(0x27,5), rra=M.op(0x67,5), sax=M.op(0x87),
-    slo=M.op(0x07,5), sre=M.op(0x47,5),
+    adc=op(0x65), ['and']=op(0x25), asl=op(0x06,5), bit=op(0x24), cmp=op(0xc5), cpx=op(0xe4), cpy=op(0xc4), dec=op(0xc6,5),
+    eor=op(0x45), inc=op(0xe6,5), lda=op(0xa5), ldx=op(0xa6), ldy=op(0xa4), lsr=op(0x46,5), ora=op(0x05), rol=op(0x26,5),
+    ror=op(0x66,5), sbc=op(0xe5), sta=op(0x85), stx=op(0x86), sty=op(0x84), 
+    dcp=op(0xc7,5), isb=op(0xe7,5), jam=op(0x22,0), lax=op(0xa7), nop=op(0x04), rla=op(0x27,5), rra=op(0x67,5), sax=op(0x87),
+    slo=op(0x07,5), sre=op(0x47,5),
 } M.opzpg = opzpg
 for k,v in pairs(opzpg) do
     M[k .. 'zpg'] = function(late, early)
         local l65dbg = { info=debug.getinfo(2, 'Sl'), trace=debug.traceback(nil, 1) }
         local size = function() late,early = M.size_op(late,early) return 2 end
         local bin = function() local l65dbg=l65dbg return { v.opc, M.op_eval_byte(late,early) } end
-        table.insert(M.section_current.instructions, { size=size, cycles=v.cycles, bin=bin })
+        table.insert(M.section_current.instructions, { op=k, mode='zpg', late=late, early=early, size=size, cycles=v.cycles, bin=bin })
     end
 end
 
 cycles_def=4 xcross_def=0 local opabs={
-    adc=M.op(0x6d), ['and']=M.op(0x2d), asl=M.op(0x0e,6), bit=M.op(0x2c), cmp=M.op(0xcd), cpx=M.op(0xec), cpy=M.op(0xcc), dec=M.op(0xce,6),
-    eor=M.op(0x4d), inc=M.op(0xee,6), jmp=M.op(0x4c,3), jsr=M.op(0x20,6), lda=M.op(0xad), ldx=M.op(0xae), ldy=M.op(0xac), lsr=M.op(0x4e,6),
-    ora=M.op(0x0d), rol=M.op(0x2e,6), ror=M.op(0x6e,6), sbc=M.op(0xed), sta=M.op(0x8d), stx=M.op(0x8e), sty=M.op(0x8c),
-    dcp=M.op(0xcf,6), isb=M.op(0xef,6), jam=M.op(0x72,0), lax=M.op(0xaf), nop=M.op(0x0c), rla=M.op(0x2f,6), rra=M.op(0x6f,6), sax=M.op(0x8f),
-    slo=M.op(0x0f,6), sre=M.op(0x4f,6),
+    adc=op(0x6d), ['and']=op(0x2d), asl=op(0x0e,6), bit=op(0x2c), cmp=op(0xcd), cpx=op(0xec), cpy=op(0xcc), dec=op(0xce,6),
+    eor=op(0x4d), inc=op(0xee,6), jmp=op(0x4c,3), jsr=op(0x20,6), lda=op(0xad), ldx=op(0xae), ldy=op(0xac), lsr=op(0x4e,6),
+    ora=op(0x0d), rol=op(0x2e,6), ror=op(0x6e,6), sbc=op(0xed), sta=op(0x8d), stx=op(0x8e), sty=op(0x8c),
+    dcp=op(0xcf,6), isb=op(0xef,6), jam=op(0x72,0), lax=op(0xaf), nop=op(0x0c), rla=op(0x2f,6), rra=op(0x6f,6), sax=op(0x8f),
+    slo=op(0x0f,6), sre=op(0x4f,6),
 } M.opabs = opabs
 for k,v in pairs(opabs) do
     M[k .. 'abs'] = function(late, early)
@@ -74,14 +75,14 @@ for k,v in pairs(opabs) do
             local x = M.op_eval_word(late,early)
             return { v.opc, x&0xff, x>>8 }
         end
-        table.insert(M.section_current.instructions, { size=size, cycles=v.cycles, bin=bin })
+        table.insert(M.section_current.instructions, { op=k, mode='abs', late=late, early=early, size=size, cycles=v.cycles, bin=bin })
     end
 end
 local opzab={} M.opabs = opabs
 for k,_ in pairs(opzpg) do if opabs[k] then opzab[k]=true end end
 for k,_ in pairs(opzab) do
     M[k .. 'zab'] = function(late, early)
-        if type(late) ~= 'function' then
+        if type(late) ~= 'function' and not M.is_expr(late) then
             local x = (early or 0) + late
             if zeropage(x) then return M[k .. 'zpg'](late, early) end
             if x >= -32768 and x <= 0xffff then return M[k .. 'abs'](late, early) end
@@ -89,9 +90,9 @@ for k,_ in pairs(opzab) do
         end
         local l65dbg = { info=debug.getinfo(2, 'Sl'), trace=debug.traceback(nil, 1) }
         local abs = opabs[k]
-        local ins = { cycles=abs.cycles }
+        local ins = { op=k, mode='zab', late=late, early=early, cycles=abs.cycles }
         ins.size = function() local l65dbg=l65dbg 
-            local r,x = M.pcall_za(M.op_eval, late, early)
+            local r,x = M.op_try(late, early)
             if not r then return 3 end
             M.size_ref(x)
             x = M.word_normalize(x)
@@ -117,24 +118,24 @@ for k,_ in pairs(opzab) do
 end
 
 cycles_def=4 xcross_def=0 local opzpx={
-    adc=M.op(0x75), ['and']=M.op(0x35), asl=M.op(0x16,6), cmp=M.op(0xd5), dec=M.op(0xd6,6), eor=M.op(0x55), inc=M.op(0xf6,6), lda=M.op(0xb5),
-    ldy=M.op(0xb4), lsr=M.op(0x56,6), ora=M.op(0x15), rol=M.op(0x36,6), ror=M.op(0x76,6), sbc=M.op(0xf5), sta=M.op(0x95), sty=M.op(0x94),
-    dcp=M.op(0xd7,6), isb=M.op(0xf7,6), jam=M.op(0x32,0), nop=M.op(0x14), rla=M.op(0x37,6), rra=M.op(0x77,6), slo=M.op(0x17,6), sre=M.op(0x57,6),
+    adc=op(0x75), ['and']=op(0x35), asl=op(0x16,6), cmp=op(0xd5), dec=op(0xd6,6), eor=op(0x55), inc=op(0xf6,6), lda=op(0xb5),
+    ldy=op(0xb4), lsr=op(0x56,6), ora=op(0x15), rol=op(0x36,6), ror=op(0x76,6), sbc=op(0xf5), sta=op(0x95), sty=op(0x94),
+    dcp=op(0xd7,6), isb=op(0xf7,6), jam=op(0x32,0), nop=op(0x14), rla=op(0x37,6), rra=op(0x77,6), slo=op(0x17,6), sre=op(0x57,6),
 } M.opzpx = opzpx
 for k,v in pairs(opzpx) do
     M[k .. 'zpx'] = function(late, early)
         local l65dbg = { info=debug.getinfo(2, 'Sl'), trace=debug.traceback(nil, 1) }
         local size = function() late,early = M.size_op(late,early) return 2 end
         local bin = function() local l65dbg=l65dbg return { v.opc, M.op_eval_byte(late,early) } end
-        table.insert(M.section_current.instructions, { size=size, cycles=v.cycles, bin=bin })
+        table.insert(M.section_current.instructions, { op=k, mode='zpx', late=late, early=early, size=size, cycles=v.cycles, bin=bin })
     end
 end
 
 cycles_def=4 xcross_def=1 local opabx={
-    adc=M.op(0x7d), ['and']=M.op(0x3d), asl=M.op(0x1e,7,0), cmp=M.op(0xdd), dec=M.op(0xde,7,0), eor=M.op(0x5d), inc=M.op(0xfe,7,0), lda=M.op(0xbd),
-    ldy=M.op(0xbc), lsr=M.op(0x5e,7,0), ora=M.op(0x1d), rol=M.op(0x3e,7,0), ror=M.op(0x7e,7,0), sbc=M.op(0xfd), sta=M.op(0x9d,5,0),
-    dcp=M.op(0xdf,7,0), isb=M.op(0xff,7,0), jam=M.op(0x92,0,0), nop=M.op(0x1c), rla=M.op(0x3f,7,0), rra=M.op(0x7f,7,0), shy=M.op(0x9c,5,0), slo=M.op(0x1f,7,0),
-    sre=M.op(0x5f,7,0),
+    adc=op(0x7d), ['and']=op(0x3d), asl=op(0x1e,7,0), cmp=op(0xdd), dec=op(0xde,7,0), eor=op(0x5d), inc=op(0xfe,7,0), lda=op(0xbd),
+    ldy=op(0xbc), lsr=op(0x5e,7,0), ora=op(0x1d), rol=op(0x3e,7,0), ror=op(0x7e,7,0), sbc=op(0xfd), sta=op(0x9d,5,0),
+    dcp=op(0xdf,7,0), isb=op(0xff,7,0), jam=op(0x92,0,0), nop=op(0x1c), rla=op(0x3f,7,0), rra=op(0x7f,7,0), shy=op(0x9c,5,0), slo=op(0x1f,7,0),
+    sre=op(0x5f,7,0),
 } M.opabx = opabx
 for k,v in pairs(opabx) do
     M[k .. 'abx'] = function(late, early)
@@ -144,14 +145,14 @@ for k,v in pairs(opabx) do
             local x = M.op_eval_word(late,early)
             return { v.opc, x&0xff, x>>8 }
         end
-        table.insert(M.section_current.instructions, { size=size, cycles=v.cycles, bin=bin })
+        table.insert(M.section_current.instructions, { op=k, mode='abx', late=late, early=early, size=size, cycles=v.cycles, xcross=v.xcross, bin=bin })
     end
 end
 local opzax={} M.opabx = opabx
 for k,_ in pairs(opzpx) do if opabx[k] then opzax[k]=true end end
 for k,_ in pairs(opzax) do
     M[k .. 'zax'] = function(late, early)
-        if type(late) ~= 'function' then
+        if type(late) ~= 'function' and not M.is_expr(late) then
             local x = (early or 0) + late
             if zeropage(x) then return M[k .. 'zpx'](late, early) end
             if x >= -32768 and x <= 0xffff then return M[k .. 'abx'](late, early) end
@@ -159,9 +160,9 @@ for k,_ in pairs(opzax) do
         end
         local l65dbg = { info=debug.getinfo(2, 'Sl'), trace=debug.traceback(nil, 1) }
         local abx = opabx[k]
-        local ins = { cycles=abx.cycles }
+        local ins = { op=k, mode='zax', late=late, early=early, cycles=abx.cycles, xcross=abx.xcross }
         ins.size = function() local l65dbg=l65dbg 
-            local r,x = M.pcall_za(M.op_eval, late, early)
+            local r,x = M.op_try(late, early)
             if not r then return 3 end
             M.size_ref(x)
             x = M.word_normalize(x)
@@ -169,6 +170,7 @@ for k,_ in pairs(opzax) do
             if zpv and zpx then
                 ins.size = 2
                 ins.cycles = zpx.cycles
+                ins.xcross = nil
                 ins.bin = function() return { zpx.opc, zpv } end
                 return 2
             end
@@ -187,23 +189,23 @@ for k,_ in pairs(opzax) do
 end
 
 cycles_def=4 xcross_def=0 local opzpy={
-    ldx=M.op(0xb6), stx=M.op(0x96),
-    jam=M.op(0x42,0), lax=M.op(0xb7), sax=M.op(0x97),
+    ldx=op(0xb6), stx=op(0x96),
+    jam=op(0x42,0), lax=op(0xb7), sax=op(0x97),
 } M.opzpy = opzpy
 for k,v in pairs(opzpy) do
     M[k .. 'zpy'] = function(late, early)
         local l65dbg = { info=debug.getinfo(2, 'Sl'), trace=debug.traceback(nil, 1) }
         local size = function() late,early = M.size_op(late,early) return 2 end
         local bin = function() local l65dbg=l65dbg return { v.opc, M.op_eval_byte(late,early) } end
-        table.insert(M.section_current.instructions, { size=size, cycles=v.cycles, bin=bin })
+        table.insert(M.section_current.instructions, { op=k, mode='zpy', late=late, early=early, size=size, cycles=v.cycles, bin=bin })
     end
 end
 
 cycles_def=4 xcross_def=1 local opaby={
-    adc=M.op(0x79), ['and']=M.op(0x39), cmp=M.op(0xd9), eor=M.op(0x59), lda=M.op(0xb9), ldx=M.op(0xbe), ora=M.op(0x19), sbc=M.op(0xf9),
-    sta=M.op(0x99,5,0), 
-    dcp=M.op(0xdb,7,0), isb=M.op(0xfb,7,0), jam=M.op(0xb2,0,0), las=M.op(0xbb), lax=M.op(0xbf), rla=M.op(0x3b,7,0), rra=M.op(0x7b,7,0), sha=M.op(0x9f,5,0),
-    shs=M.op(0x9b,5,0), shx=M.op(0x9e,5,0), slo=M.op(0x1b,7,0), sre=M.op(0x5b,7,0),
+    adc=op(0x79), ['and']=op(0x39), cmp=op(0xd9), eor=op(0x59), lda=op(0xb9), ldx=op(0xbe), ora=op(0x19), sbc=op(0xf9),
+    sta=op(0x99,5,0), 
+    dcp=op(0xdb,7,0), isb=op(0xfb,7,0), jam=op(0xb2,0,0), las=op(0xbb), lax=op(0xbf), rla=op(0x3b,7,0), rra=op(0x7b,7,0), sha=op(0x9f,5,0),
+    shs=op(0x9b,5,0), shx=op(0x9e,5,0), slo=op(0x1b,7,0), sre=op(0x5b,7,0),
 } M.opaby = opaby
 for k,v in pairs(opaby) do
     M[k .. 'aby'] = function(late, early)
@@ -213,14 +215,14 @@ for k,v in pairs(opaby) do
             local x = M.op_eval_word(late,early)
             return { v.opc, x&0xff, x>>8 }
         end
-        table.insert(M.section_current.instructions, { size=size, cycles=v.cycles, bin=bin })
+        table.insert(M.section_current.instructions, { op=k, mode='aby', late=late, early=early, size=size, cycles=v.cycles, xcross=v.xcross, bin=bin })
     end
 end
 local opzay={} M.opaby = opaby
 for k,_ in pairs(opzpy) do if opaby[k] then opzay[k]=true end end
 for k,_ in pairs(opzay) do
     M[k .. 'zay'] = function(late, early)
-        if type(late) ~= 'function' then
+        if type(late) ~= 'function' and not M.is_expr(late) then
             local x = (early or 0) + late
             if zeropage(x) then return M[k .. 'zpy'](late, early) end
             if x >= -32768 and x <= 0xffff then return M[k .. 'aby'](late, early) end
@@ -228,9 +230,9 @@ for k,_ in pairs(opzay) do
         end
         local l65dbg = { info=debug.getinfo(2, 'Sl'), trace=debug.traceback(nil, 1) }
         local aby = opaby[k]
-        local ins = { cycles=aby.cycles }
+        local ins = { op=k, mode='zay', late=late, early=early, cycles=aby.cycles, xcross=aby.xcross }
         ins.size = function() local l65dbg=l65dbg
-            local r,x = M.pcall_za(M.op_eval, late, early)
+            local r,x = M.op_try(late, early)
             if not r then return 3 end
             M.size_ref(x)
             x = M.word_normalize(x)
@@ -238,6 +240,7 @@ for k,_ in pairs(opzay) do
             if zpv and zpy then
                 ins.size = 2
                 ins.cycles = zpy.cycles
+                ins.xcross = nil
                 ins.bin = function() return { zpy.opc, zpv } end
                 return 2
             end
@@ -256,19 +259,29 @@ for k,_ in pairs(opzay) do
 end
 
 cycles_def=2 xcross_def=0 local oprel={
-    bcc=M.op(0x90), bcs=M.op(0xb0), beq=M.op(0xf0), bmi=M.op(0x30), bne=M.op(0xd0), bpl=M.op(0x10), bvc=M.op(0x50), bvs=M.op(0x70),
+    bcc=op(0x90), bcs=op(0xb0), beq=op(0xf0), bmi=op(0x30), bne=op(0xd0), bpl=op(0x10), bvc=op(0x50), bvs=op(0x70),
 } M.oprel = oprel
 for k,v in pairs(oprel) do
     M[k .. 'rel'] = function(label)
         local l65dbg = { info=debug.getinfo(2, 'Sl'), trace=debug.traceback(nil, 1) }
-        local parent,offset = M.label_current
+        local parent = M.label_current
         local section,rorg = M.section_current,M.location_current.rorg
-        local op = { cycles=2 }
+        local op = { op=k, mode='rel', target=label, parent=parent, cycles=2, rel=true }
         op.size = function()
-            offset = section.size
             label = M.size_dc(label)
             return 2
         end
+        -- a target out of range within the section turns the branch into
+        -- the inverted branch skipping over a jmp to the target
+        op.relax = function()
+            if op.far then return end
+            local target = M.label_offset(label, parent, section)
+            if not target then return end
+            local x = target-2 - op.offset
+            if x >= -128 and x <= 127 then return end
+            op.far,op.size,op.cycles,op.cycles_worst = true,5,3,5
+            return true
+        end
         op.bin = function() local l65dbg=l65dbg 
             local x,l = label,label
             if type(x) == 'function' then x=x() end
@@ -277,7 +290,8 @@ for k,v in pairs(oprel) do
                 x = symbols[x]
             end
             if type(x) ~= 'number' then error("unresolved branch target: " .. tostring(x)) end
-            x = x-2 - offset - rorg(section.org)
+            if op.far then return { v.opc ~ 0x20, 3, opabs.jmp.opc, x&0xff, x>>8 } end
+            x = x-2 - op.offset - rorg(section.org)
             if x < -128 or x > 127 then error("branch target out of range for " .. l .. ": " .. x) end
             return { v.opc, x&0xff }
         end
@@ -286,8 +300,8 @@ for k,v in pairs(oprel) do
 end
 
 cycles_def=5 xcross_def=0 local opind={
-    jmp=M.op(0x6c),
-    jam=M.op(0xd2,0),
+    jmp=op(0x6c),
+    jam=op(0xd2,0),
 } M.opind = opind
 for k,v in pairs(opind) do
     M[k .. 'ind'] = function(late, early)
@@ -297,36 +311,122 @@ for k,v in pairs(opind) do
             local x = M.op_eval_word(late,early)
             return { v.opc, x&0xff, x>>8 }
         end
-        table.insert(M.section_current.instructions, { size=size, cycles=v.cycles, bin=bin })
+        table.insert(M.section_current.instructions, { op=k, mode='ind', late=late, early=early, size=size, cycles=v.cycles, bin=bin })
     end
 end
 
 cycles_def=6 xcross_def=0 local opinx={
-    adc=M.op(0x61), ['and']=M.op(0x21), cmp=M.op(0xc1), eor=M.op(0x41), lda=M.op(0xa1), ora=M.op(0x01), sbc=M.op(0xe1), sta=M.op(0x81),
-    dcp=M.op(0xc3,8), isb=M.op(0xe3,8), jam=M.op(0x52,0), lax=M.op(0xa3), rla=M.op(0x23,8), rra=M.op(0x63,8), sax=M.op(0x83), slo=M.op(0x03,8),
-    sre=M.op(0x43,8),
+    adc=op(0x61), ['and']=op(0x21), cmp=op(0xc1), eor=op(0x41), lda=op(0xa1), ora=op(0x01), sbc=op(0xe1), sta=op(0x81),
+    dcp=op(0xc3,8), isb=op(0xe3,8), jam=op(0x52,0), lax=op(0xa3), rla=op(0x23,8), rra=op(0x63,8), sax=op(0x83), slo=op(0x03,8),
+    sre=op(0x43,8),
 } M.opinx = opinx
 for k,v in pairs(opinx) do
     M[k .. 'inx'] = function(late, early)
         local l65dbg = { info=debug.getinfo(2, 'Sl'), trace=debug.traceback(nil, 1) }
         local size = function() late,early = M.size_op(late,early) return 2 end
         local bin = function() local l65dbg=l65dbg return { v.opc, M.op_eval_byte(late,early) } end
-        table.insert(M.section_current.instructions, { size=size, cycles=v.cycles, bin=bin })
+        table.insert(M.section_current.instructions, { op=k, mode='inx', late=late, early=early, size=size, cycles=v.cycles, bin=bin })
     end
 end
 
 cycles_def=5 xcross_def=1 local opiny={
-    adc=M.op(0x71), ['and']=M.op(0x31), cmp=M.op(0xd1), eor=M.op(0x51), lda=M.op(0xb1), ora=M.op(0x11), sbc=M.op(0xf1), sta=M.op(0x91,6),
-    dcp=M.op(0xd3,8), isb=M.op(0xf3,8), jam=M.op(0x62,0,0), lax=M.op(0xb3), rla=M.op(0x33,8), rra=M.op(0x73,8), sha=M.op(0x93,6), slo=M.op(0x13,8),
-    sre=M.op(0x53,8),
-}
+    adc=op(0x71), ['and']=op(0x31), cmp=op(0xd1), eor=op(0x51), lda=op(0xb1), ora=op(0x11), sbc=op(0xf1), sta=op(0x91,6,0),
+    dcp=op(0xd3,8,0), isb=op(0xf3,8,0), jam=op(0x62,0,0), lax=op(0xb3), rla=op(0x33,8,0), rra=op(0x73,8,0), sha=op(0x93,6,0), slo=op(0x13,8,0),
+    sre=op(0x53,8,0),
+} M.opiny = opiny
 for k,v in pairs(opiny) do
     M[k .. 'iny'] = function(late, early)
         local l65dbg = { info=debug.getinfo(2, 'Sl'), trace=debug.traceback(nil, 1) }
         local size = function() late,early = M.size_op(late,early) return 2 end
         local bin = function() local l65dbg=l65dbg return { v.opc, M.op_eval_byte(late,early) } end
-        table.insert(M.section_current.instructions, { size=size, cycles=v.cycles, bin=bin })
+        table.insert(M.section_current.instructions, { op=k, mode='iny', late=late, early=early, size=size, cycles=v.cycles, xcross=v.xcross, bin=bin })
     end
 end
 
+-- peephole rules, see asm.lua peephole()
+local loads = { lda=true, ldx=true, ldy=true }
+local stores = { sta=true, stx=true, sty=true }
+local direct = { zpg=true, abs=true, zab=true }
+local transfers = { tax='txa', txa='tax', tay='tya', tya='tay' }
+local jump_label = function(instruction, parent)
+    if instruction.op ~= 'jmp' or instruction.mode ~= 'abs' then return end
+    local _,label = M.op_key(instruction.late, instruction.early, parent)
+    return label
+end
+M.peephole_rules = {
+    -- jmp to the instruction right after it
+    function(ins, i, last, parent)
+        local label = jump_label(ins[i], parent)
+        if not label then return end
+        for j=i+1,#ins do
+            if ins[j] == label then return i,1,3,3 end
+            if ins[j].type ~= 'label' then return end
+        end
+    end,
+    -- jmp to rts
+    function(ins, i, last, parent)
+        local label = jump_label(ins[i], parent)
+        local target = label and M.label_next(label)
+        if not target or target.op ~= 'rts' then return end
+        return i,1,2,3,{ op='rts', mode='imp', size=1, cycles=target.cycles, bin=target.bin }
+    end,
+    -- load of the immediate value the register already holds, with only
+    -- stores in between, which leave registers and flags unchanged
+    function(ins, i, last, parent)
+        local a = ins[i]
+        if not loads[a.op] or a.mode ~= 'imm' then return end
+        local key = M.op_key(a.late, a.early, parent)
+        if not key then return end
+        for j=i+1,last do
+            local b = ins[j]
+            if b.op == a.op and b.mode == 'imm' and M.op_key(b.late, b.early, parent) == key then return j,1,2,2 end
+            if not stores[b.op] then return end
+        end
+    end,
+    -- second store of the same register to the same RAM address
+    function(ins, i, last, parent)
+        local a,b = ins[i],ins[i+1]
+        if i == last or not stores[a.op] or not direct[a.mode] or b.op ~= a.op or not direct[b.mode] then return end
+        local key = M.op_key(a.late, a.early, parent)
+        if not key or key ~= M.op_key(b.late, b.early, parent) or not M.peephole_ram(key) then return end
+        if b.mode == 'abs' or b.mode == 'zab' and not zeropage(key) then return i+1,1,3,4 end
+        return i+1,1,2,3
+    end,
+    -- transfer back between the same registers: both hold the same value
+    function(ins, i, last)
+        local a,b = ins[i],ins[i+1]
+        if i < last and transfers[a.op] and b.op == transfers[a.op] then return i+1,1,1,2 end
+    end,
+}
+
+-- modes of ram_var() operands picking zero page, or requiring it
+M.ram_modes = { zab='auto', zax='auto', zay='auto', zpg='required', zpx='required', zpy='required', inx='required', iny='required' }
+
+-- call graph of ram_local() and callgraph(): bytes pushed by calls and jumps
+-- to other sections, and by stack instructions
+M.call_ops = { jsr=2, jmp=0 }
+M.stack_ops = { pha=1, php=1, pla=-1, plp=-1 }
+M.interrupt_stack = 3
+
+-- cycle counting simulator for bench() and fastest()
+M.simulator = function() return require"sim6502".new() end
+
+-- modes of the instructions the formatter pre-encodes into __blob() runs,
+-- and their decoding for the peephole rules
+M.blob_modes = { imp=true, imm=true, abs=true }
+local blob_ops = {}
+for mode,ops in pairs{ imp=opimp, imm=opimm, abs=opabs } do
+    for k,v in pairs(ops) do blob_ops[v.opc] = { op=k, mode=mode } end
+end
+M.blob_decode = function(ins)
+    local code = ins.code
+    local decoded = blob_ops[code[1]]
+    if not decoded then return end
+    ins.op,ins.mode = decoded.op,decoded.mode
+    if #code == 2 then ins.late = code[2] elseif #code == 3 then ins.late = code[2] | code[3]<<8 end
+end
+
+-- opcodes after which execution does not continue with the next instruction
+M.opflow = { [opabs.jmp.opc]=true, [opind.jmp.opc]=true, [opimp.rts.opc]=true, [opimp.rti.opc]=true, [opimp.brk.opc]=true }
+
 return M
@@ -7,11 +7,38 @@ local relations={} M.relations=relations
 local stats={} M.stats=stats setmetatable(stats, stats)
 
 local before_link={} M.before_link=before_link
+local benchmarks={} M.benchmarks=benchmarks
+local ram_vars={} M.ram_vars=ram_vars
+local ram_locals={} M.ram_locals=ram_locals
+local budgets={} M.budgets=budgets
+local exports={} M.exports=exports
 M.bin_filler = 0 -- brk opcode on 6502
 M.bin_finalizer = function() end
+M.index_max = 0xff -- highest X/Y index value assumed by worst case cycle analysis
+M.patch = false -- set to 'ips' or 'bps' to also write a patch against the previous binary in writebin()
 
 M.strip = true  -- set to false to disable dead stripping of relocatable sections
+M.strip_unreachable = false -- set to true to strip relocatable sections unreachable from strong, ORG or exported ones
+M.pack_budget = false -- set to a number of seconds to search for a better placement than the greedy one
+M.layout = false -- set to a filename to keep relocatable sections at their address from the previous link
+M.profile = false -- set to a filename of execution counts written by profile_import() to keep hot branches within a page
 M.strip_empty = false -- set to true to strip empty sections: their label will then not resolve
+M.relax_jumps = false -- set to true to shrink absolute jumps to relative branches when their target is in range
+M.optimize = false -- set to true to run the CPU peephole_rules over sections before link
+M.peephole_rules = {} -- filled by CPU modules, see peephole()
+M.peephole_ram = function(address) end -- platforms return true for plain RAM, where repeated stores are redundant
+M.ram_fast = false -- address ranges { {first,last}, ... } or allocator function(size) for the hottest ram_var(), eg. zero page
+M.ram_slow = false -- address ranges or allocator function(size) for the other ram_var()
+M.ram_profile = false -- set to a filename of 'name count' access counts overriding the estimated ones of ram_var()
+M.ram_modes = {} -- instruction modes which pick a short form ('auto') or require it ('required'), set by CPU modules
+M.entry_points = false -- list of entry point labels, main one first, then the interrupt handlers, for ram_local() and callgraph()
+M.call_ops = false -- set by CPU modules: bytes pushed by each call or jump opcode, see callgraph()
+M.stack_ops = {} -- set by CPU modules: bytes pushed, or popped if negative, by each stack opcode
+M.interrupt_stack = 0 -- set by CPU modules: bytes pushed when an interrupt is taken
+M.blob_modes = {} -- set by CPU modules: instruction modes whose constant operands encode the same at parse time, see blob_capture()
+M.cycles_of = false -- set by CPU modules without cycle counts per instruction: function(bytes) returning the worst case cycles
+M.bank_size = false -- set by platform modules: bytes per bank of physical addresses, for the 'bank:address' lines of profile_import()
+M.simulator = false -- set by CPU modules to a function returning a new cycle counting simulator, see bench()
 M.pcall = pcall -- set to empty function returning false to disable eval during compute_size()
 -- set to pcall directly if you want to keep ldazab/x/y eval during compute_size() even if
 -- disabled for other parts (required to distinguish automatically between zp/abs addressing)
@@ -32,24 +59,235 @@ setmetatable(M, symbols)
 local id_ = 0
 local id = function() id_=id_+1 return id_ end M.id=id
 
+-- Return the constant bytes of an overlap section, or nil if any of its
+-- instructions is not constant data.
+local overlap_bytes = function(section)
+    if section.align or #section.constraints > 0 or #section.holes > 0 or section.related then return end
+    local bytes = {}
+    for _,instruction in ipairs(section.instructions) do
+        if instruction.type ~= 'label' then
+            if not instruction.data then return end
+            local r,b = pcall(instruction.bin)
+            if not r or type(b) ~= 'table' then return end
+            table.move(b,1,#b,#bytes+1,bytes)
+        end
+    end
+    if #bytes ~= section.size then return end
+    return bytes
+end
+
+-- Length of the longest suffix of 'a' which is also a prefix of 'b', using
+-- the KMP failure table 'fb' of 'b'.
+local overlap_length = function(a, b, fb)
+    local k = 0
+    for i=1,#a do
+        local c = a[i]
+        while k > 0 and b[k+1] ~= c do k = fb[k] end
+        if b[k+1] == c then k = k + 1 end
+    end
+    return k
+end
+
+local overlap_failure = function(b)
+    local f,k = { [0]=0, 0 },0
+    for i=2,#b do
+        while k > 0 and b[k+1] ~= b[i] do k = f[k] end
+        if b[k+1] == b[i] then k = k + 1 end
+        f[i] = k
+    end
+    return f
+end
+
+-- Merge the constant data of the 'overlap' sections in 'list' using greedy
+-- shortest superstring: sections contained within another one are placed
+-- inside it, and the others are chained by their longest suffix/prefix
+-- overlap. Return the list of sections to position, with each merged group
+-- replaced by a proxy section whose 'members' maps sections to offsets, and
+-- the number of bytes saved.
+local overlap_pack = function(list)
+    local items,rest = {},{}
+    for _,section in ipairs(list) do
+        local bytes = section.overlap and overlap_bytes(section)
+        if bytes then
+            local str = {}
+            for i=1,#bytes,0x4000 do str[#str+1] = string.char(table.unpack(bytes, i, math.min(i+0x3fff, #bytes))) end
+            table.insert(items, { section=section, bytes=bytes, str=table.concat(str) })
+        else table.insert(rest, section) end
+    end
+    if #items < 2 then return list,0 end
+
+    -- containment: longest first, so that a container is never itself contained
+    table.sort(items, function(a,b) if #a.bytes==#b.bytes then return a.section.id<b.section.id end return #a.bytes>#b.bytes end)
+    local kept = {}
+    for _,item in ipairs(items) do
+        for _,host in ipairs(kept) do
+            local at = host.str:find(item.str, 1, true)
+            if at then item.host,item.at = host,at-1 break end
+        end
+        if not item.host then table.insert(kept, item) end
+    end
+
+    -- greedy chaining on pairwise overlaps
+    local pairs_ = {}
+    for _,b in ipairs(kept) do
+        local fb = overlap_failure(b.bytes)
+        for _,a in ipairs(kept) do if a ~= b then
+            local k = overlap_length(a.bytes, b.bytes, fb)
+            if k > 0 then table.insert(pairs_, { a=a, b=b, k=k }) end
+        end end
+    end
+    table.sort(pairs_, function(x,y)
+        if x.k ~= y.k then return x.k > y.k end
+        if x.a.section.id ~= y.a.section.id then return x.a.section.id < y.a.section.id end
+        return x.b.section.id < y.b.section.id
+    end)
+    local head = function(item) while item.prev do item = item.prev end return item end
+    for _,p in ipairs(pairs_) do
+        if not p.a.next and not p.b.prev and head(p.a) ~= p.b then
+            p.a.next,p.a.k,p.b.prev = p.b,p.k,p.a
+        end
+    end
+
+    local saved = 0
+    local out = rest
+    for _,item in ipairs(kept) do if not item.prev then
+        local members,offset,size,count = {},0,0,0
+        local it = item
+        while it do
+            it.offset = offset
+            members[it.section] = offset
+            size = offset + #it.bytes
+            count = count + 1
+            offset = offset + #it.bytes - (it.k or 0)
+            it = it.next
+        end
+        item.members,item.size,item.count = members,size,count
+    end end
+    for _,item in ipairs(items) do if item.host then
+        local host = head(item.host)
+        host.members[item.section] = item.host.offset + item.at
+        host.count = host.count + 1
+    end end
+    for _,item in ipairs(kept) do if not item.prev then
+        if item.count == 1 then
+            table.insert(out, item.section)
+        else
+            local proxy = { type='section', id=item.section.id, label=item.section.label, location=item.section.location,
+                size=item.size, constraints={}, holes={}, members=item.members }
+            for section in pairs(item.members) do saved = saved + section.size end
+            saved = saved - item.size
+            table.insert(out, proxy)
+        end
+    end end
+    return out,saved
+end
+
+-- Return the section addresses of a layout file written by layout_write(),
+-- indexed by section label, or nil if the file does not exist.
+local layout_read = function(filename)
+    local f = io.open(filename, "rb")
+    if not f then return end
+    local layout = {}
+    for line in f:lines() do
+        local label,address,size = line:match'^(%S+)%s+(%x+)%s+(%d+)'
+        if label then layout[label] = { address=tonumber(address, 16), size=tonumber(size) } end
+    end
+    f:close()
+    return layout
+end
+
+-- Return the execution counts of a profile file written by profile_import(),
+-- as count tables indexed by section label then offset, and the number of
+-- frames the profile covers, or nil if the file does not exist.
+local profile_read = function(filename)
+    local f = io.open(filename, "rb")
+    if not f then return end
+    local profile,frames = {}
+    for line in f:lines() do
+        local label,offset,count = line:match'^([^%s+]+)%+?(%d*)%s+(%d+)'
+        if label == 'frames' then frames = tonumber(count)
+        elseif label then
+            local counts = profile[label] or {}
+            profile[label] = counts
+            offset = tonumber(offset) or 0
+            counts[offset] = (counts[offset] or 0) + tonumber(count)
+        end
+    end
+    f:close()
+    return profile,frames
+end
+
+-- Return the branches of 'section' taken in 'profile' counts, with the
+-- offsets of the byte following the branch and of its target, and their
+-- estimated taken count: the smallest of the branch and target counts.
+local profile_branches = function(section, counts)
+    local branches = {}
+    for _,instruction in ipairs(section.instructions) do
+        if instruction.rel and instruction.target and not instruction.far then
+            local target = M.label_offset(instruction.target, instruction.parent, section)
+            local count = target and math.min(counts[instruction.offset] or 0, counts[target] or 0)
+            if count and count > 0 then
+                table.insert(branches, { next=instruction.offset + 2, target=target, count=count })
+            end
+        end
+    end
+    if #branches > 0 then return branches end
+end
+
+-- Return the cycles the 'branches' of a section at 'address' lose to page
+-- crossings.
+local profile_penalty = function(branches, rorg, address)
+    local penalty = 0
+    for _,branch in ipairs(branches) do
+        if (rorg(address + branch.next) ~ rorg(address + branch.target)) & 0xff00 ~= 0 then
+            penalty = penalty + branch.count
+        end
+    end
+    return penalty
+end
+
+-- Write the address and size of every relocatable section into 'filename'.
+local layout_write = function(filename)
+    local s,ins = {},table.insert
+    for _,location in ipairs(locations) do
+        for _,section in ipairs(location.sections) do
+            if section.relocatable and section.org then
+                ins(s, string.format("%s %04x %d", section.label, section.org, section.size))
+            end
+        end
+    end
+    table.sort(s)
+    local f = assert(io.open(filename, "wb"), "failed to open " .. filename .. " for writing")
+    f:write(table.concat(s, '\n'), '\n') f:close()
+end
+
 M.link = function()
     if stats.unused then return end
 
     for _,v in ipairs(before_link) do v() end
+    if #ram_vars > 0 or #ram_locals > 0 then M.ram_allocate()
+    elseif M.entry_points or #budgets > 0 then M.callgraph() end
+
+    stats.peephole_bytes,stats.peephole_cycles = 0,0
+    if M.optimize then for _,section in ipairs(sections) do M.peephole(section) end end
 
+    local early = {}
+    for _,section in ipairs(sections) do if section.refcount > 0 then early[section] = true end end
     if M.strip then
         symbols.__index = function(tab,key)
             local val = rawget(symbols, key)
-            if type(val) == 'table' and val.type == 'label' then
-                val.section.refcount = val.section.refcount + 1
-            end
+            if type(val) == 'table' and val.type == 'label' then M.size_ref(val) end
             return val
         end
     end
+    stats.relaxed = 0
     for _,section in ipairs(sections) do
+        M.section_sizing = section
         section:compute_size()
     end
+    M.section_sizing = nil
     symbols.__index = symbols
+    local reachable = M.strip and M.strip_unreachable and M.reachable(early)
 
     local chunk_reserve = function(section, chunk_ix)
         local chunks = section.location.chunks
@@ -128,9 +366,14 @@ M.link = function()
     local position_section = function(section, constrain)
         local location = section.location
         local chunks,rorg = location.chunks,location.rorg
+        local branches = section.branches
+        -- with profiled branches, the page crossing penalty comes first and
+        -- every chunk is considered; 'plain' is the position chosen without
+        local best,plain
         table.sort(chunks, function(a,b) if a.size==b.size then return a.id<b.id end return a.size<b.size end)
         for chunk_ix,chunk in ipairs(chunks) do if chunk.size >= section.size then
             local waste,cross,lsb,position = math.maxinteger,math.maxinteger,math.maxinteger
+            local penalty,pwaste,pcross,plsb,pposition = math.maxinteger,math.maxinteger,math.maxinteger,math.maxinteger
             local usage_lowest = function(start, finish)
                 local inc=1
                 if section.align then
@@ -147,6 +390,15 @@ M.link = function()
                             nwaste, ncross, nlsb = constrain(address, nwaste, ncross, nlsb)
                             if not nwaste then goto skip end
                         end
+                        local npenalty = 0
+                        if branches then
+                            npenalty = profile_penalty(branches, rorg, address)
+                            if not plain and (nwaste < pwaste or nwaste == pwaste and (ncross < pcross or ncross == pcross and nlsb <= plsb)) then
+                                pposition,pwaste,pcross,plsb = address,nwaste,ncross,nlsb
+                            end
+                            if npenalty > penalty then goto skip end
+                            if npenalty < penalty then goto keep end
+                        end
                         if nwaste > waste then goto skip end
                         if nwaste == waste then
                             -- if waste is the same, keep the one that uses the least amount of aligned addresses
@@ -156,7 +408,8 @@ M.link = function()
                                 if nlsb > lsb then goto skip end
                             end
                         end
-                        position,waste,cross,lsb = address,nwaste,ncross,nlsb
+                        ::keep::
+                        position,penalty,waste,cross,lsb = address,npenalty,nwaste,ncross,nlsb
                         ::skip::
                     end
                 end
@@ -167,7 +420,11 @@ M.link = function()
                 local start = math.max(chunk.start + chunk.size - section.size - 0xff, chunk.start)
                 usage_lowest(start, chunk.start + chunk.size - section.size)
             end
-            if position then
+            if branches and position then
+                plain = plain or profile_penalty(branches, rorg, pposition)
+                if not best or penalty < best.penalty then best = { position=position, chunk_ix=chunk_ix, penalty=penalty } end
+                if penalty == 0 then break end
+            elseif position then
                 section.org = position
                 chunk_reserve(section, chunk_ix)
                 --print(section.label, string.format("%04X\t%d", position, section.size))
@@ -175,11 +432,153 @@ M.link = function()
                 return position
             end
         end end
+        if best then
+            section.org = best.position
+            section.profile_penalty,section.profile_saved = best.penalty,plain - best.penalty
+            stats.profile_saved = stats.profile_saved + section.profile_saved
+            chunk_reserve(section, best.chunk_ix)
+            return best.position
+        end
+    end
+
+    local largest_chunk = function(chunks)
+        local largest = 0
+        for _,chunk in ipairs(chunks) do largest = math.max(largest, chunk.size) end
+        return largest
+    end
+
+    -- candidate positions of a section: the lowest and highest valid addresses
+    -- of each chunk, and the valid addresses closest to each page boundary,
+    -- ordered by the same waste/cross/lsb scoring as position_section
+    local pack_candidates = function(section)
+        local rorg,inc = section.location.rorg,section.align or 1
+        local out,seen = {},{}
+        local scan = function(address, first, last, dir)
+            if section.align then
+                local raddress = rorg(address) - (section.offset or 0)
+                local delta = raddress % section.align
+                if dir > 0 then address = address + (delta > 0 and section.align-delta or 0)
+                else address = address - delta end
+            end
+            for _=1,0x100 do
+                if address < first or address > last then return end
+                if not seen[address] then
+                    local waste,cross,lsb = check_section_position(section, address)
+                    if waste then
+                        seen[address] = true
+                        out[#out+1] = { address=address, waste=waste, cross=cross, lsb=lsb }
+                        return
+                    end
+                end
+                address = address + dir*inc
+            end
+        end
+        for _,chunk in ipairs(section.location.chunks) do if chunk.size >= section.size then
+            local first,last = chunk.start,chunk.start+chunk.size-section.size
+            scan(first, first, last, 1)
+            scan(last, first, last, -1)
+            local page = first + (0x100 - rorg(first) % 0x100) % 0x100
+            while page <= last + section.size do
+                scan(page, first, last, 1)
+                scan(page - section.size, first, last, -1)
+                page = page + 0x100
+            end
+        end end
+        table.sort(out, function(a,b)
+            if a.waste ~= b.waste then return a.waste < b.waste end
+            if a.cross ~= b.cross then return a.cross < b.cross end
+            if a.lsb ~= b.lsb then return a.lsb < b.lsb end
+            return a.address < b.address
+        end)
+        return out
+    end
+
+    -- Place 'list' into the chunks of 'location', keeping the placement which
+    -- leaves the largest contiguous free chunk among the greedy one and those
+    -- found by a depth first search bounded by 'budget' seconds.
+    local pack_sections = function(location, list, budget)
+        local chunks = location.chunks
+        local snapshot = function() return table.move(chunks, 1, #chunks, 1, {}) end
+        local restore = function(saved)
+            for i=#chunks,1,-1 do chunks[i] = nil end
+            table.move(saved, 1, #saved, 1, chunks)
+        end
+        local initial = snapshot()
+
+        local greedy,greedy_score,failed = {}
+        for _,section in ipairs(list) do
+            if not position_section(section) then failed = section break end
+            greedy[section] = section.org
+        end
+        if not failed then greedy_score = largest_chunk(chunks) end
+        for _,section in ipairs(list) do section.org = nil end
+        restore(initial)
+
+        local best,best_score = greedy,greedy_score
+        -- the largest free chunk can't exceed the free space left once all are placed
+        local free = 0
+        for _,chunk in ipairs(chunks) do free = free + chunk.size end
+        for _,section in ipairs(list) do free = free - section.size end
+        local placed = {}
+        local deadline = os.clock() + budget
+        local timeout = false
+        local function search(i)
+            if os.clock() > deadline then timeout = true return end
+            if i > #list then
+                local score = largest_chunk(chunks)
+                if not best_score or score > best_score then
+                    best,best_score = {},score
+                    for section,address in pairs(placed) do best[section] = address end
+                end
+                return
+            end
+            if best_score and best_score >= free then return end
+            local section = list[i]
+            if section.size > largest_chunk(chunks) then return end
+            for _,candidate in ipairs(pack_candidates(section)) do
+                local saved = snapshot()
+                section.org = candidate.address
+                local _,chunk_ix = chunk_from_address(section, candidate.address)
+                chunk_reserve(section, chunk_ix)
+                placed[section] = candidate.address
+                search(i+1)
+                placed[section] = nil
+                section.org = nil
+                restore(saved)
+                if timeout then return end
+            end
+        end
+        search(1)
+        restore(initial)
+
+        if not best_score then return nil,failed end
+        for _,section in ipairs(list) do
+            section.org = best[section]
+            local _,chunk_ix = chunk_from_address(section, section.org)
+            chunk_reserve(section, chunk_ix)
+        end
+        location.pack_gain = greedy_score and best_score - greedy_score
+        location.pack_timeout = timeout
+        return location.pack_gain or 0
     end
 
     stats.used = 0
     stats.unused = 0
     stats.cycles = 0
+    stats.pack_gain = 0
+    stats.layout_kept = 0
+    local layout = M.layout and layout_read(M.layout)
+    stats.overlapped = 0
+    stats.stripped = {}
+    stats.profile_saved,stats.profile_frames = 0,nil
+    local profile,frames
+    if M.profile then profile,frames = profile_read(M.profile) end
+    if profile then
+        stats.profile_frames = frames
+        for _,section in ipairs(sections) do
+            section.branches = profile[section.label] and profile_branches(section, profile[section.label])
+        end
+    end
     local related_sections = {}
     for _,location in ipairs(locations) do
         local sections,rorg = location.sections,location.rorg
@@ -200,9 +599,14 @@ M.link = function()
                     section.org = location.start
                 end
             elseif not section.org then
-                if M.strip and not section.refcount and not section.strong then 
+                section.relocatable = true
+                local dead
+                if reachable then dead = not reachable[section]
+                else dead = not section.refcount and not section.strong end
+                if M.strip and dead then
                     sections[ix]=nil
                     table.insert(symbols_to_remove, section.label)
+                    table.insert(stats.stripped, section)
                 elseif section.related then
                     table.insert(related_sections, section)
                 else
@@ -214,6 +618,11 @@ M.link = function()
             if sections[i] ~= nil then j=j+1 sections[j],sections[i] = sections[i],sections[j] end
         end end
         for _,v in ipairs(symbols_to_remove) do symbols[v] = nil end
+        local overlapped
+        position_independent_sections,overlapped = overlap_pack(position_independent_sections)
+        location.overlapped = overlapped
+        location.used = location.used - overlapped
+        stats.overlapped = stats.overlapped + overlapped
         location.position_independent_sections = position_independent_sections
         stats.cycles = stats.cycles + location.cycles
         stats.used = stats.used + location.used
@@ -274,9 +683,65 @@ M.link = function()
     for _,location in ipairs(locations) do
         local position_independent_sections = location.position_independent_sections
         table.sort(position_independent_sections, function(a,b) if a.size==b.size then return a.label>b.label end return a.size>b.size end)
+        -- place 'list', returning the first section which did not fit, if any
+        local place = function(list)
+            if M.pack_budget and location.finish then
+                local gain,failed = pack_sections(location, list, M.pack_budget)
+                if not gain then return failed end
+                stats.pack_gain = stats.pack_gain + gain
+            else
+                for _,section in ipairs(list) do
+                    if not position_section(section) then return section end
+                end
+            end
+        end
+        local failed
+        if layout then
+            -- keep sections at their previous address when they still fit
+            -- there, those with an unchanged size first
+            local initial = table.move(location.chunks, 1, #location.chunks, 1, {})
+            local previous,kept = {},0
+            for _,section in ipairs(position_independent_sections) do
+                if layout[section.label] then table.insert(previous, section) end
+            end
+            table.sort(previous, function(a,b)
+                local la,lb = layout[a.label],layout[b.label]
+                local sa,sb = la.size==a.size,lb.size==b.size
+                if sa ~= sb then return sa end
+                return la.address < lb.address
+            end)
+            for _,section in ipairs(previous) do
+                local address = layout[section.label].address
+                if check_section_position(section, address) then
+                    section.org = address
+                    local _,chunk_ix = chunk_from_address(section, address)
+                    chunk_reserve(section, chunk_ix)
+                    kept = kept + 1
+                end
+            end
+            local unplaced = {}
+            for _,section in ipairs(position_independent_sections) do
+                if not section.org then table.insert(unplaced, section) end
+            end
+            failed = place(unplaced)
+            if failed then
+                -- previous layout leaves no room: position everything again
+                for _,section in ipairs(position_independent_sections) do section.org = nil end
+                for i=#location.chunks,1,-1 do location.chunks[i] = nil end
+                table.move(initial, 1, #initial, 1, location.chunks)
+                kept = 0
+                failed = place(position_independent_sections)
+            end
+            stats.layout_kept = stats.layout_kept + kept
+        else
+            failed = place(position_independent_sections)
+        end
+        if failed then
+            error("unable to find space for section '" .. failed.label .. "' of size " .. failed.size)
+        end
         for _,section in ipairs(position_independent_sections) do
-            if not position_section(section) then
-                error("unable to find space for section '" .. section.label .. "' of size " .. section.size)
+            if section.members then
+                for member,offset in pairs(section.members) do member.org = section.org + offset end
             end
         end
 
@@ -293,6 +758,434 @@ M.link = function()
         stats.unused = stats.unused + unused
 
     end
+
+    if M.layout then layout_write(M.layout) end
+end
+
+-- Mark the sections reachable from the roots through the references
+-- recorded in their 'refs' during compute_size(), and through relations.
+-- Roots are strong and ORG sections, and sections of labels listed in
+-- 'exports'. Set 'reached_from' on each reachable section to the
+-- section it was first reached from, or to a string naming its root kind.
+-- 'early' is an optional set of sections referenced before link phase.
+M.reachable = function(early)
+    local reachable,stack = {},{}
+    local mark = function(section, from)
+        if section and not reachable[section] then
+            reachable[section] = true
+            section.reached_from = from
+            stack[#stack+1] = section
+        end
+    end
+    for _,section in ipairs(sections) do
+        if section.strong then mark(section, 'strong')
+        elseif section.org then mark(section, 'org')
+        elseif early and early[section] then mark(section, 'early reference') end
+    end
+    for _,name in ipairs(M.exports) do
+        local label = rawget(symbols, name)
+        mark(type(label) == 'table' and label.section, 'export')
+    end
+    while #stack > 0 do
+        local section = table.remove(stack)
+        for ref in pairs(section.refs) do mark(ref, section) end
+        for relative in pairs(relations[section] or {}) do mark(relative, section) end
+    end
+    return reachable
+end
+
+-- ram_var(name [, size])
+-- Declare a variable of 'size' bytes, 1 by default, placed by link phase
+-- into 'ram_fast' or 'ram_slow' according to its access count, and return
+-- its name, also set as global, for use as operand.
+M.ram_var = function(name, size)
+    assert(type(name) == 'string', "ram_var name must be a string")
+    if symbols[name] then error("duplicate symbol: " .. name) end
+    local var = { name=name, size=size or 1, count=0 }
+    table.insert(ram_vars, var)
+    ram_vars[name] = var
+    rawset(_ENV, name, name)
+    return name
+end
+
+-- Return an allocator function(size) for 'ram', a list of address ranges,
+-- or an allocator function itself.
+local ram_allocator = function(ram)
+    if type(ram) == 'function' or not ram then return ram end
+    local free = {}
+    for i,range in ipairs(ram) do free[i] = { range[1], range[2] } end
+    return function(size)
+        for _,range in ipairs(free) do
+            if range[2] - range[1] + 1 >= size then
+                local address = range[1]
+                range[1] = range[1] + size
+                return address
+            end
+        end
+    end
+end
+
+-- Count the accesses to each ram_var() in the instructions of all sections,
+-- weighting by 8 each loop around them, a loop being a branch back to a
+-- label of the same section; 'ram_profile' counts replace the estimates.
+-- Then place variables by decreasing count per byte, first those accessed
+-- by instructions requiring a short form, into 'ram_fast' while it has
+-- room, and into 'ram_slow' otherwise.
+M.ram_allocate = function()
+    local base,stride = 0x1000000,0x10000
+    for i,var in ipairs(ram_vars) do var.count,var.required = 0,nil symbols[var.name] = base + i*stride end
+    for _,section in ipairs(sections) do
+        local instructions,index = section.instructions,{}
+        for i,instruction in ipairs(instructions) do if instruction.type == 'label' then index[instruction] = i end end
+        local depth = {}
+        for i,instruction in ipairs(instructions) do if instruction.target and not (M.call_ops and (M.call_ops[instruction.op] or 0) > 0) then
+            local label = M.find_label(instruction.target, instruction.parent)
+            local first = label and index[label]
+            if first and first < i then for j=first,i do depth[j] = (depth[j] or 0) + 1 end end
+        end end
+        for i,instruction in ipairs(instructions) do
+            local mode = M.ram_modes[instruction.mode]
+            if mode and instruction.late ~= nil then
+                local ok,v = M.pcall(M.op_eval, instruction.late, instruction.early)
+                local var = ok and type(v) == 'number' and v >= base + stride and ram_vars[(v - base) // stride]
+                if var then
+                    var.count = var.count + 8^math.min(depth[i] or 0, 4)
+                    if mode == 'required' then var.required = true end
+                end
+            end
+        end
+    end
+    for _,var in ipairs(ram_vars) do symbols[var.name] = nil end
+    if M.ram_profile then
+        local f = io.open(M.ram_profile, "rb")
+        if f then
+            for line in f:lines() do
+                local name,count = line:match'^(%S+)%s+(%d+)'
+                if name and ram_vars[name] then ram_vars[name].count = tonumber(count) end
+            end
+            f:close()
+        end
+    end
+    local order = table.move(ram_vars, 1, #ram_vars, 1, {})
+    table.sort(order, function(a,b)
+        if (a.required or false) ~= (b.required or false) then return a.required end
+        local da,db = a.count/a.size,b.count/b.size
+        if da ~= db then return da > db end
+        return a.name < b.name
+    end)
+    local fast,slow = ram_allocator(M.ram_fast),ram_allocator(M.ram_slow)
+    stats.ram_fast,stats.ram_slow = 0,0
+    if #ram_locals > 0 then
+        local graph = M.callgraph()
+        local size = graph.locals_peak
+        local address = size > 0 and (fast and fast(size) or slow and slow(size))
+        if size > 0 and not address then error("no room left in ram_fast nor ram_slow for " .. size .. " bytes of ram_local()") end
+        for _,var in ipairs(ram_locals) do
+            var.address = address + var.section.locals_offset + var.offset
+            symbols[var.name] = var.address
+        end
+    end
+    for _,var in ipairs(order) do
+        local address = var.count > 0 or var.required or not slow
+        address = address and fast and fast(var.size)
+        if address then
+            var.fast = true
+            stats.ram_fast = stats.ram_fast + var.size
+        else
+            if var.required then error("no room left in ram_fast for " .. var.name .. ", which needs a short form") end
+            address = slow and slow(var.size)
+            if not address then error("no room left in ram_slow for " .. var.name .. " of size " .. var.size) end
+            stats.ram_slow = stats.ram_slow + var.size
+        end
+        var.address = address
+        symbols[var.name] = address
+    end
+end
+
+-- ram_local(name [, size])
+-- Declare a variable of 'size' bytes, 1 by default, local to the routine
+-- of the current section, and return its name, also set as global. Locals
+-- of routines which cannot be active at the same time share addresses.
+M.ram_local = function(name, size)
+    assert(type(name) == 'string', "ram_local name must be a string")
+    local section = M.section_current
+    if not section then error("ram_local " .. name .. " outside of a section") end
+    if symbols[name] then error("duplicate symbol: " .. name) end
+    section.locals_size = section.locals_size or 0
+    local var = { name=name, size=size or 1, section=section, offset=section.locals_size }
+    section.locals_size = section.locals_size + var.size
+    table.insert(ram_locals, var)
+    ram_locals[name] = var
+    rawset(_ENV, name, name)
+    return name
+end
+
+-- Return the label called or jumped to by 'instruction', found through its
+-- 'target' or by evaluating its operand.
+local call_label = function(instruction)
+    local label
+    if instruction.target then label = M.find_label(instruction.target, instruction.parent)
+    elseif M.is_expr(instruction.late) then
+        if instruction.late.name then M.pcall(M.expr_apply, instruction.late, function(v)
+            if type(v) == 'function' then v = v() end
+            label = M.find_label(v)
+            return 0
+        end) end
+    elseif type(instruction.late) == 'function' then
+        M.pcall(instruction.late, instruction.early or 0, function(v)
+            if type(v) == 'function' then v = v() end
+            label = label or M.find_label(v)
+            return 0
+        end)
+    else label = M.find_label(instruction.late) end
+    return label
+end
+
+-- callgraph()
+-- Build the graph of calls between sections from the 'call_ops' of the CPU
+-- and branches to other sections, keeping the targets of branches within a
+-- section for cycles_budget(), then compute the maximum stack depth of each routine and entry point, and
+-- overlay the ram_local() variables: the locals of a routine are placed
+-- above those of all its callers, the ones of each interrupt handler above
+-- those of the entry points before it, and the ones of routines reachable
+-- from several entry points in a range of their own. Return the graph, also kept
+-- into stats. Called by link phase when there are ram_local() variables or
+-- 'entry_points' are set, before section sizes are computed.
+M.callgraph = function()
+    local call_ops,stack_ops = M.call_ops or {},M.stack_ops
+    local nodes,order = {},{}
+    for _,section in ipairs(sections) do
+        local node = { section=section, calls={}, callees={}, branches={}, push=0, size=section.locals_size or 0, callers=0 }
+        nodes[section] = node
+        table.insert(order, node)
+    end
+    for _,node in ipairs(order) do
+        local depth = 0
+        for _,instruction in ipairs(node.section.instructions) do
+            local bytes = call_ops[instruction.op] or instruction.target and 0
+            local label = bytes and call_label(instruction)
+            local callee = label and label.section
+            if callee == node.section then node.branches[instruction] = label
+            elseif callee and nodes[callee] then
+                table.insert(node.calls, { node=nodes[callee], push=depth + bytes })
+                node.callees[instruction] = nodes[callee]
+                nodes[callee].callers = nodes[callee].callers + 1
+            end
+            depth = math.max(0, depth + (stack_ops[instruction.op] or 0))
+            node.push = math.max(node.push, depth)
+        end
+    end
+
+    -- stack depth, nil through recursive calls
+    local visiting = {}
+    local function stack(node)
+        if node.stack ~= nil or visiting[node] then return node.stack end
+        visiting[node] = true
+        local depth = node.push
+        for _,call in ipairs(node.calls) do
+            local d = stack(call.node)
+            depth = d and depth and math.max(depth, call.push + d)
+        end
+        visiting[node] = nil
+        node.stack = depth or false
+        return node.stack
+    end
+
+    local entries = {}
+    for i,name in ipairs(M.entry_points or {}) do
+        local label = M.find_label(name)
+        if label and nodes[label.section] then
+            table.insert(entries, { name=name, node=nodes[label.section], interrupt=i > 1 })
+        end
+    end
+    local roots = {}
+    for _,node in ipairs(order) do if node.callers == 0 and node.section.instructions[1] then
+        local listed
+        for _,entry in ipairs(entries) do listed = listed or entry.node == node end
+        if not listed then table.insert(roots, node) end
+    end end
+    if #entries == 0 then table.insert(entries, { name=roots[1] and roots[1].section.label, roots=roots })
+    else entries[1].roots = roots end
+
+    -- overlay locals: relax offsets over the routines reachable from each entry
+    local peak = 0
+    if not M.call_ops then
+        for _,node in ipairs(order) do node.offset = peak peak = peak + node.size end
+    end
+    local entered = {}
+    for _,entry in ipairs(entries) do
+        local reach,list = {},{}
+        local function visit(node) if not reach[node] then
+            reach[node] = true
+            table.insert(list, node)
+            for _,call in ipairs(node.calls) do visit(call.node) end
+        end end
+        if entry.node then visit(entry.node) end
+        for _,node in ipairs(entry.roots or {}) do visit(node) end
+        entry.reach = list
+        for _,node in ipairs(list) do entered[node] = (entered[node] or 0) + 1 end
+    end
+    for _,entry in ipairs(entries) do
+        -- routines reachable from several entries are placed afterwards
+        local list = {}
+        for _,node in ipairs(entry.reach) do if entered[node] == 1 then table.insert(list, node) end end
+        if M.call_ops then for _,node in ipairs(list) do node.offset = math.max(node.offset or 0, peak) end end
+        for pass=1,M.call_ops and #list+1 or 0 do
+            local changed
+            for _,node in ipairs(list) do for _,call in ipairs(node.calls) do
+                if entered[call.node] == 1 and call.node.offset < node.offset + node.size then
+                    if pass > #list then error("recursive call to " .. call.node.section.label .. " with ram_local() variables") end
+                    call.node.offset,changed = node.offset + node.size,true
+                end
+            end end
+            if not changed then break end
+        end
+        for _,node in ipairs(list) do peak = math.max(peak, node.offset + node.size) end
+        local depth = entry.node and stack(entry.node)
+        for _,node in ipairs(entry.roots or {}) do local d = stack(node) depth = d and math.max(depth or 0, d) end
+        entry.stack = depth and depth + (entry.interrupt and M.interrupt_stack or 0)
+        entry.locals = peak
+    end
+    -- a routine reachable from several entries may be interrupted by another
+    -- entry running any of its own routines, so it gets a range of its own
+    -- above all of them
+    if M.call_ops then
+        for _,node in ipairs(order) do if (entered[node] or 0) > 1 then
+            node.offset = peak
+            peak = peak + node.size
+        end end
+        for _,entry in ipairs(entries) do
+            for _,node in ipairs(entry.reach) do entry.locals = math.max(entry.locals, node.offset + node.size) end
+        end
+    end
+    for _,entry in ipairs(entries) do entry.reach = nil end
+    for _,node in ipairs(order) do node.section.locals_offset = node.offset or 0 end
+
+    local graph = { nodes=order, entries=entries, locals_peak=peak }
+    stats.locals_peak,stats.stack_depth = peak,{}
+    for _,entry in ipairs(entries) do if entry.name then stats.stack_depth[entry.name] = entry.stack or false end end
+    stats.callgraph = graph
+    return graph
+end
+
+-- Return a text report of the call graph: for each routine, its locals, their
+-- offset in the overlay, its stack depth and its callees, then for each entry
+-- point the stack depth and the RAM needed by the locals up to it.
+M.callgraph_report = function()
+    local graph = stats.callgraph or M.callgraph()
+    local s,ins = {},table.insert
+    for _,node in ipairs(graph.nodes) do if #node.calls > 0 or node.size > 0 then
+        local callees = {}
+        for _,call in ipairs(node.calls) do ins(callees, call.node.section.label) end
+        ins(s, string.format("%-24s locals %3d at +%-3d stack %-9s calls %s", node.section.label, node.size, node.offset or 0,
+            node.stack and tostring(node.stack) or "recursive", table.concat(callees, ' ')))
+    end end
+    for _,entry in ipairs(graph.entries) do if entry.name then
+        ins(s, string.format("entry %s: stack %s bytes, locals %d bytes", entry.name,
+            entry.stack and tostring(entry.stack) or "unbounded (recursive)", entry.locals))
+    end end
+    ins(s, string.format("%d bytes of locals overlaid into %d bytes", (function()
+        local n = 0 for _,var in ipairs(ram_locals) do n = n + var.size end return n end)(), graph.locals_peak))
+    return table.concat(s, '\n')
+end
+
+-- Return a text report of the ram_var() placement, with the access count of
+-- each variable.
+M.ram_report = function()
+    local s,ins = {},table.insert
+    for _,var in ipairs(ram_vars) do if var.address then
+        ins(s, string.format("%-24s %04x %5d %10d %s", var.name, var.address, var.size, math.tointeger(var.count) or var.count,
+            var.fast and (var.required and "fast, required" or "fast") or "slow"))
+    end end
+    table.sort(s)
+    ins(s, string.format("%d bytes fast, %d bytes slow", stats.ram_fast or 0, stats.ram_slow or 0))
+    return table.concat(s, '\n')
+end
+
+-- Return a text report of the sections removed by dead stripping: for each,
+-- its size, and the dead sections still referencing it, if any.
+M.strip_report = function()
+    local s,ins = {},table.insert
+    local total = 0
+    for _,section in ipairs(stats.stripped or {}) do
+        local from = {}
+        for _,other in ipairs(stats.stripped) do
+            if other.refs[section] then ins(from, other.label) end
+        end
+        table.sort(from)
+        local why = #from == 0 and "unreferenced" or "referenced only from stripped " .. table.concat(from, ', ')
+        ins(s, string.format("%-24s %5d  %s", section.label, section.size, why))
+        total = total + section.size
+    end
+    ins(s, string.format("%d section(s) stripped, %d bytes", #(stats.stripped or {}), total))
+    return table.concat(s, '\n')
+end
+
+-- Convert the emulator trace or execution count file 'trace' into a profile
+-- file 'filename' for the 'profile' property, using the current link: each
+-- line of 'trace' starts with a hexadecimal CPU address, optionally prefixed
+-- with its bank as in 'bank:address', and followed by its execution count
+-- when the line has exactly two fields; other lines count once. The profile
+-- records counts per section label and offset, so that they still apply
+-- after sections move.
+M.profile_import = function(trace, filename, frames)
+    M.resolve()
+    local counts = {}
+    local f = assert(io.open(trace, "rb"), "failed to open " .. trace .. " for reading")
+    for line in f:lines() do
+        local bank,address,rest = line:match'^%s*(%x+):(%x+)(.*)$'
+        if not bank then address,rest = line:match'^%s*(%x+)(.*)$' end
+        if address and (rest == '' or rest:match'^[%s:]') then
+            local count = rest:match'^%s+(%d+)%s*$'
+            counts[#counts+1] = { bank=bank and tonumber(bank, 16), address=tonumber(address, 16), count=tonumber(count) or 1 }
+        end
+    end
+    f:close()
+    -- sections by CPU page, as banks share their CPU addresses
+    local pages = {}
+    for _,location in ipairs(locations) do
+        for _,section in ipairs(location.sections) do if section.org and section.size > 0 then
+            local start = location.rorg(section.org)
+            local bank = M.bank_size and section.org // M.bank_size
+            for page=start>>8,(start+section.size-1)>>8 do
+                pages[page] = pages[page] or {}
+                table.insert(pages[page], { start=start, section=section, bank=bank })
+            end
+        end end
+    end
+    local profile = {}
+    for _,c in ipairs(counts) do
+        for _,entry in ipairs(pages[c.address>>8] or {}) do
+            local offset = c.address - entry.start
+            if offset >= 0 and offset < entry.section.size and (not c.bank or not entry.bank or c.bank == entry.bank) then
+                local key = entry.section.label .. '+' .. offset
+                profile[key] = (profile[key] or 0) + c.count
+            end
+        end
+    end
+    local s = {}
+    for key,count in pairs(profile) do s[#s+1] = key .. ' ' .. count end
+    table.sort(s)
+    if frames then table.insert(s, 1, 'frames ' .. frames) end
+    f = assert(io.open(filename, "wb"), "failed to open " .. filename .. " for writing")
+    f:write(table.concat(s, '\n'), '\n') f:close()
+end
+
+-- Return a text report of the sections placed using the profile, with the
+-- cycles their branches lose to page crossings and the cycles saved over
+-- the placement without profile, per frame when the profile has frames.
+M.profile_report = function()
+    local s,ins = {},table.insert
+    local frames = stats.profile_frames or 1
+    local fmt = function(cycles) return string.format("%.1f", cycles / frames) end
+    for _,section in ipairs(sections) do if section.profile_saved then
+        ins(s, string.format("%-24s %04x %8s %8s", section.label, section.location.rorg(section.org),
+            fmt(section.profile_penalty), fmt(section.profile_saved)))
+    end end
+    table.sort(s)
+    table.insert(s, 1, string.format("%-24s %4s %8s %8s", "section", "addr", "lost", "saved"))
+    ins(s, string.format("%s cycles saved per %s", fmt(stats.profile_saved or 0), stats.profile_frames and "frame" or "run"))
+    return table.concat(s, '\n')
 end
 
 M.resolve = function()
@@ -317,10 +1210,75 @@ M.resolve = function()
     setmetatable(symbols, llresolver)
 end
 
+-- Return the 'file:line' position of a source script from debug 'info'.
+local source_line = function(info)
+    return string.format("%s:%d", (info.short_src:gsub('%[string "(.-)"%]', '%1')), info.currentline)
+end
+
+-- Return the extra cycles the instruction at 'address' encoded as 'b' takes
+-- in the worst case: page crossing of indexed accesses ('xcross'), taken
+-- branches, and taken branches crossing a page ('rel').
+local cycles_extra = function(instruction, address, b)
+    if instruction.cycles_worst then return instruction.cycles_worst - instruction.cycles end
+    if type(b) ~= 'table' then return 0 end
+    local xcross = instruction.xcross
+    if xcross and xcross > 0 then
+        if #b < 3 then return xcross end -- indirect pointer, unknown base
+        local base = b[2] | b[3]<<8
+        if (base & 0xff) + M.index_max > 0xff then return xcross end
+        return 0
+    end
+    if instruction.rel then
+        local next = address + #b
+        local target = next + (b[2] ~ 0x80) - 0x80
+        return (next & 0xff00) == (target & 0xff00) and 1 or 2
+    end
+    return 0
+end
+
+-- Return the best and worst case cycles of instructions 'from' to 'to' of
+-- 'section', over the paths through the branches and jumps within them: a
+-- branch costs its cycles not taken when it falls through and its worst case
+-- when taken, and leaving the block by a branch or a jump ends the path. A
+-- branch back is counted once, taken or not.
+local block_cycles = function(section, from, to, bests, worsts)
+    local instructions,rorg,index = section.instructions,section.location.rorg,{}
+    for i=to,from,-1 do if instructions[i].type == 'label' then index[rorg(section.org + instructions[i].offset)] = i end end
+    local best,worst = { [from]=0 },{ [from]=0 }
+    local edge = function(i, j, b, w)
+        if j < from or j > to then j = to+1 end
+        best[j] = math.min(best[j] or math.huge, best[i] + b)
+        worst[j] = math.max(worst[j] or -1, worst[i] + w)
+    end
+    for i=from,to do if best[i] then
+        local instruction,b = instructions[i],section.codes[i]
+        local opc = type(b) == 'table' and b[1] or b
+        local flow = M.opflow and M.opflow[opc] and not instruction.data
+        local target
+        if instruction.rel and instruction.target then
+            local name = instruction.target
+            if name:sub(1,1) == '_' and instruction.parent then name = instruction.parent .. name end
+            target = rawget(symbols, name)
+        elseif flow and instruction.late and instruction.mode ~= 'ind' then
+            local r,v = M.op_try(instruction.late, instruction.early)
+            if r then target = v end
+        end
+        local j = index[target]
+        if j and j <= i then edge(i, i+1, bests[i], worsts[i])
+        else
+            if instruction.rel or flow then edge(i, j or to+1, worsts[i], worsts[i]) end
+            if not flow then edge(i, i+1, bests[i], instruction.rel and bests[i] or worsts[i]) end
+        end
+    end end
+    return best[to+1] or 0,worst[to+1] or 0
+end
+
 M.genbin = function(filler)
     if #locations == 0 then return end
     if filler == nil then filler = M.bin_filler end
     M.resolve()
+    stats.cycles_best,stats.cycles_worst = 0,0
+    local violations = {}
     local bin = {}
     local ins,mov = table.insert,table.move
     table.sort(locations, function(a,b) return a.start < b.start end)
@@ -331,13 +1289,17 @@ M.genbin = function(filler)
             error(string.format("location [%04x,%04x] overlaps another", location.start, location.finish or location.stops_at))
         end
         if fill then for i=#bin+of0,location.start-1 do ins(bin, filler) end end
-        M.size=0 M.cycles=0
-        local sections = location.sections
+        M.size=0 M.cycles=0 M.cycles_worst=0
+        local sections,rorg = location.sections,location.rorg
         table.sort(sections, function(a,b) return a.org < b.org end)
         for _,section in ipairs(sections) do
             for i=#bin+of0,section.org-1 do ins(bin, filler) end
             local bin_offset = math.min(#bin, section.org-of0)+1
-            for _,instruction in ipairs(section.instructions) do
+            local blocks,block,label = {},nil,section.label
+            local bests,worsts,codes = {},{},{}
+            section.cycles_best,section.cycles_worst,section.blocks = 0,0,blocks
+            section.worsts,section.codes = worsts,codes
+            for i,instruction in ipairs(section.instructions) do
                 local b,o = instruction.bin
                 if type(b) == 'function' then b,o = b(filler) end
                 if type(b) == 'table' then mov(b,1,#b,bin_offset,bin) bin_offset=bin_offset+#b
@@ -346,69 +1308,709 @@ M.genbin = function(filler)
                     bin_offset=bin_offset+o
                     for i=#bin,bin_offset-1 do ins(bin, filler) end
                 end
-                M.size=#bin M.cycles=M.cycles+(instruction.cycles or 0)
+                -- basic blocks start at labels and after flow changes
+                if instruction.type == 'label' then
+                    label = instruction.label
+                    if block and block.size == 0 then block.label = label else block = nil end
+                end
+                local offset = instruction.offset or 0
+                if not block then
+                    block = { label=label, address=rorg(section.org+offset), size=0, cycles_best=0, cycles_worst=0 }
+                    ins(blocks, block)
+                end
+                local cycles = instruction.cycles or 0
+                local worst = cycles + cycles_extra(instruction, rorg(section.org+offset), b)
+                bests[i],worsts[i],codes[i] = cycles,worst,b
+                block.size = block.size + (type(b) == 'table' and #b or b and 1 or 0) + (o or 0)
+                block.cycles_best = block.cycles_best + cycles
+                block.cycles_worst = block.cycles_worst + worst
+                section.cycles_best = section.cycles_best + cycles
+                section.cycles_worst = section.cycles_worst + worst
+                local opc = type(b) == 'table' and b[1] or b
+                if instruction.rel or M.opflow and M.opflow[opc] and not instruction.data then block = nil end
+                M.size=#bin M.cycles=M.cycles+cycles M.cycles_worst=M.cycles_worst+worst
             end
+            stats.cycles_best = stats.cycles_best + section.cycles_best
+            stats.cycles_worst = stats.cycles_worst + section.cycles_worst
+            for _,constraint in ipairs(section.constraints) do if constraint.cycles then
+                local best,worst = block_cycles(section, constraint.from, constraint.to, bests, worsts)
+                local n = constraint.cycles
+                if constraint.type == 'cycles_max' and worst > n or constraint.type == 'cycles_exact' and (best ~= n or worst ~= n) then
+                    table.insert(violations, string.format("%s: %s(%d) block takes %s cycles", source_line(constraint.info),
+                        constraint.type, n, best == worst and best or best .. " to " .. worst))
+                end
+            end end
         end
         fill = not location.nofill
         if location.finish and fill then
             for i=#bin+of0,location.finish do ins(bin, filler) end
         end
     end
+    if #budgets > 0 and not stats.budgets then M.budget_check(violations) end
+    if #violations > 0 then error(table.concat(violations, '\n'), 0) end
     stats.bin_size = #bin
     return bin
 end
 
+-- cycles_budget(label, cycles [, warn])
+-- Check after link that the worst case path from the routine of section
+-- 'label' until it returns, or reaches a budget_end(), fits in 'cycles':
+-- genbin fails with the critical path otherwise, or only warns if 'warn'.
+M.cycles_budget = function(label, cycles, warn)
+    table.insert(budgets, { label=label, cycles=cycles, warn=warn, info=debug.getinfo(2, 'Sl') })
+end
+
+-- budget_end()
+-- Mark the point where the time window of cycles_budget() closes, eg. the
+-- end of VRAM updates in a vblank handler.
+M.budget_end = function()
+    table.insert(M.section_current.instructions, { type='budget_end', size=0 })
+end
+
+-- loop_bound(n)
+-- Set the iteration count of the loop closed by the next branch back, for
+-- cycles_budget(); loops without a bound are counted once.
+M.loop_bound = function(n)
+    table.insert(M.section_current.instructions, { type='loop_bound', bound=n, size=0 })
+end
+
+-- Return the cycles_of() the bytes 'b' of 'instruction', part by part for
+-- a __blob() run.
+local blob_cycles = function(instruction, b)
+    if not instruction.blob then return M.cycles_of(b) end
+    local cycles,offset = 0,0
+    for _,part in ipairs(instruction.blob) do
+        cycles = cycles + M.cycles_of(table.move(b, offset+1, offset+part.size, 1, {}))
+        offset = offset + part.size
+    end
+    return cycles
+end
+
+-- Return the worst case path through the routine of 'node' until it returns,
+-- or closes the budget window, as a table of 'cycles', 'closed' and 'steps',
+-- the labels, calls and loops along it. Instruction cycles come from genbin,
+-- and loops weigh their body times their bound.
+local budget_path
+budget_path = function(node, memo, visiting)
+    if memo[node] then return memo[node] end
+    local section = node.section
+    if visiting[node] then error("recursive call to " .. section.label .. " in cycles_budget() path") end
+    visiting[node] = true
+    local instructions,worsts,codes = section.instructions,section.worsts or {},section.codes or {}
+    local index = {}
+    for i,instruction in ipairs(instructions) do index[instruction] = i end
+    local weight,succ,closed,subs,loops,bound = {},{},{},{},{}
+    for i,instruction in ipairs(instructions) do
+        local next,b = {},codes[i]
+        weight[i],succ[i] = 0,next
+        if instruction.type == 'loop_bound' then bound = instruction.bound end
+        if instruction.type == 'budget_end' then closed[i] = true
+        elseif instruction.data then table.insert(next, i+1)
+        else
+            weight[i] = (type(b) == 'table' and M.cycles_of and blob_cycles(instruction, b) or worsts[i] or 0) + (instruction.budget_cycles or 0)
+            local callee,sub = node.callees[instruction]
+            if callee then
+                sub = budget_path(callee, memo, visiting)
+                subs[i],weight[i] = sub,weight[i] + sub.cycles
+            end
+            local opc = type(b) == 'table' and b[1] or b
+            if sub and sub.closed then closed[i] = true
+            else
+                local label = node.branches[instruction]
+                local j = label and index[label]
+                if j and j > i then table.insert(next, j)
+                elseif j then table.insert(loops, { from=j, to=i, bound=bound }) bound = nil end
+                if not (M.opflow and M.opflow[opc]) then table.insert(next, i+1) end
+            end
+        end
+    end
+    weight[#instructions+1],succ[#instructions+1] = 0,{}
+    -- longest path over forward edges from 'first', in instruction order
+    local longest = function(first, last)
+        local dist,prev = { [first]=weight[first] },{}
+        for i=first,last do if dist[i] and not closed[i] then
+            for _,j in ipairs(succ[i]) do if j <= last and (not dist[j] or dist[i] + weight[j] > dist[j]) then
+                dist[j],prev[j] = dist[i] + weight[j],i
+            end end
+        end end
+        return dist,prev
+    end
+    local extra = {}
+    for _,loop in ipairs(loops) do
+        local dist = longest(loop.from, loop.to)
+        local body = dist[loop.to] or 0
+        extra[loop.to] = { label=instructions[loop.from].label, bound=loop.bound, cycles=((loop.bound or 1) - 1) * body }
+        weight[loop.to] = weight[loop.to] + extra[loop.to].cycles
+    end
+    local n = #instructions
+    local dist,prev = longest(1, n + 1)
+    local last
+    for i=1,n+1 do
+        local exit = closed[i] or i <= n and #succ[i] == 0 or i == n+1
+        if dist[i] and exit and (not last or dist[i] > dist[last]) then last = i end
+    end
+    local path = {}
+    while last do table.insert(path, 1, last) last = prev[last] end
+    local rorg,steps,step = section.location.rorg,{}
+    local address = function(i) return rorg(section.org + (instructions[i] and instructions[i].offset or section.size)) end
+    local current = section.label
+    for _,i in ipairs(path) do
+        local instruction = instructions[i]
+        if instruction and instruction.type == 'label' then current = instruction.label end
+        if instruction and (instruction.type == 'label' or not step or closed[i]) then
+            step = { address=address(i), text=instruction.type == 'budget_end' and "budget_end" or current, cycles=0 }
+            table.insert(steps, step)
+        end
+        if step then step.cycles = step.cycles + weight[i] - (subs[i] and subs[i].cycles or 0) - (extra[i] and extra[i].cycles or 0) end
+        if extra[i] then
+            local loop = extra[i]
+            table.insert(steps, { address=address(i), cycles=loop.cycles,
+                text="loop " .. loop.label .. (loop.bound and " x" .. loop.bound or " unbounded, counted once"), unbounded=not loop.bound })
+            step = nil
+        end
+        if subs[i] then
+            table.insert(steps, { address=address(i), cycles=subs[i].cycles, text="call " .. subs[i].label, sub=subs[i] })
+            step = nil
+        end
+    end
+    local tail = path[#path]
+    local result = { label=section.label, cycles=tail and dist[tail] or 0, closed=tail and closed[tail], steps=steps }
+    visiting[node] = nil
+    memo[node] = result
+    return result
+end
+
+-- Check the cycles_budget() of the last link, adding the failures to
+-- 'violations' and recording the results into stats.budgets.
+M.budget_check = function(violations)
+    stats.budgets = {}
+    local graph,memo = stats.callgraph or M.callgraph(),{}
+    for _,budget in ipairs(budgets) do
+        local node
+        for _,v in ipairs(graph.nodes) do if v.section.label == budget.label then node = v end end
+        if not node then error(string.format("%s: no section %s for cycles_budget", source_line(budget.info), budget.label), 0) end
+        local path = budget_path(node, memo, {})
+        local result = { label=budget.label, budget=budget.cycles, cycles=path.cycles, path=path }
+        table.insert(stats.budgets, result)
+        if path.cycles > budget.cycles then
+            local s = string.format("%s: cycles_budget(%s) exceeded, worst case path takes %d cycles out of %d\n%s",
+                source_line(budget.info), budget.label, path.cycles, budget.cycles, M.budget_path_report(path))
+            if budget.warn then io.stderr:write("warning: ", s, "\n") else table.insert(violations, s) end
+        end
+    end
+end
+
+-- Return the text of the steps of a worst case path, calls expanded.
+M.budget_path_report = function(path, indent)
+    local s,indent = {},indent or "  "
+    for _,step in ipairs(path.steps) do
+        table.insert(s, string.format("%s%04x %-28s %6d", indent, step.address, step.text, step.cycles))
+        if step.sub then table.insert(s, M.budget_path_report(step.sub, indent .. "  ")) end
+    end
+    return table.concat(s, '\n')
+end
+
+-- Return a text report of the cycles_budget() checks with their critical path.
+M.budget_report = function()
+    if not stats.budgets then M.genbin() end
+    local s = {}
+    for _,result in ipairs(stats.budgets or {}) do
+        table.insert(s, string.format("%s: %d cycles, budget %d, %s %d", result.label, result.cycles, result.budget,
+            result.cycles > result.budget and "over by" or "margin", math.abs(result.budget - result.cycles)))
+        table.insert(s, M.budget_path_report(result.path))
+    end
+    return table.concat(s, '\n')
+end
+
+-- bench(label [, setup])
+-- Run the subroutine at 'label' (or address) on the linked binary in the
+-- CPU simulator, after 'setup(sim)' if given, and return the cycles it
+-- took, including its return, and the simulator.
+M.bench = function(label, setup)
+    if not M.simulator then error("no cycle simulator for this CPU") end
+    local bin = M.genbin()
+    local sim = M.simulator()
+    local address,org = label,label
+    if type(label) == 'string' then address,org = symbols[label],symbolsorg[label] end
+    if type(address) ~= 'number' then error("unresolved bench label: " .. tostring(label)) end
+    -- the location holding the routine is loaded last, to be mapped over other banks
+    local home
+    for _,location in ipairs(locations) do
+        sim:load(bin, location)
+        if org >= location.start and org <= (location.finish or location.start + #bin) then home = location end
+    end
+    if home then sim:load(bin, home) end
+    if setup then setup(sim) end
+    local cycles = sim:call(address)
+    table.insert(benchmarks, { type='bench', label=type(label) == 'string' and label or nil, address=address, org=org, cycles=cycles })
+    return cycles,sim
+end
+
 M.writebin = function(filename, bin)
     if not filename then filename = 'main.bin' end
     if not bin then bin = M.genbin() end
     M.bin_finalizer(bin)
-    local f = assert(io.open(filename, "wb"), "failed to open " .. filename .. " for writing")
+    local previous
+    if M.patch then
+        local f = io.open(filename, "rb")
+        if f then previous = f:read("a") f:close() end
+    end
+    local data = {}
     for i = 1, #bin, 0x4000 do
-        f:write(string.char(table.unpack(bin, i, math.min(i + 0x3fff, #bin))))
+        data[#data+1] = string.char(table.unpack(bin, i, math.min(i + 0x3fff, #bin)))
     end
+    data = table.concat(data)
+    local f = assert(io.open(filename, "wb"), "failed to open " .. filename .. " for writing")
+    f:write(data)
     f:close()
+    if previous then M.writepatch(filename .. '.' .. M.patch, previous, data, M.patch) end
+end
+
+local crc32_table = {}
+for i=0,255 do
+    local c = i
+    for _=1,8 do if c & 1 ~= 0 then c = 0xedb88320 ~ (c >> 1) else c = c >> 1 end end
+    crc32_table[i] = c
+end
+local crc32 = function(s)
+    local c,byte = 0xffffffff,string.byte
+    for i=1,#s do c = crc32_table[(c ~ byte(s, i)) & 0xff] ~ (c >> 8) end
+    return c ~ 0xffffffff
+end
+
+M.getpatch_as = {
+    -- positional records, with RLE for repeated bytes, and truncation
+    ips = function(source, target)
+        local s,ins,byte,pack = { "PATCH" },table.insert,string.byte,string.pack
+        local differs = function(i) return i > #source or byte(source, i) ~= byte(target, i) end
+        local i = 1
+        while i <= #target do
+            if differs(i) then
+                if i-1 == 0x454f46 then i = i - 1 end -- offset would read as "EOF"
+                -- extend the record over equal gaps shorter than a record header
+                local j,last = i,i
+                while j <= #target and j-i < 0xffff do
+                    if differs(j) then last = j elseif j-last > 5 then break end
+                    j = j + 1
+                end
+                if i-1 > 0xffffff then error("IPS patch can't address beyond 16MB") end
+                local data = target:sub(i, last)
+                if #data > 8 and data == data:sub(1,1):rep(#data) then
+                    ins(s, pack(">I3I2I2", i-1, 0, #data)) ins(s, data:sub(1,1))
+                else
+                    ins(s, pack(">I3I2", i-1, #data)) ins(s, data)
+                end
+                i = last + 1
+            else
+                i = i + 1
+            end
+        end
+        ins(s, "EOF")
+        if #target < #source then ins(s, pack(">I3", #target)) end
+        return table.concat(s)
+    end,
+    -- SourceRead for unchanged ranges, SourceCopy for data moved within the
+    -- image, found through an index of the source 8 bytes windows, and
+    -- TargetRead for the rest
+    bps = function(source, target)
+        local s,ins,byte,unpack = { "BPS1" },table.insert,string.byte,string.unpack
+        local num = function(v)
+            local b = {}
+            while true do
+                local x = v & 0x7f
+                v = v >> 7
+                if v == 0 then b[#b+1] = 0x80 | x break end
+                b[#b+1] = x
+                v = v - 1
+            end
+            ins(s, string.char(table.unpack(b)))
+        end
+        num(#source) num(#target) num(0)
+        local index = {}
+        for p=#source-7,1,-1 do index[unpack("<i8", source, p)] = p end
+        local literal,source_rel = nil,0
+        local flush = function(o)
+            if not literal then return end
+            num((o-literal-1) << 2 | 1) ins(s, target:sub(literal, o-1))
+            literal = nil
+        end
+        local o = 1
+        while o <= #target do
+            local l = 0
+            while o+l <= #target and o+l <= #source and byte(source, o+l) == byte(target, o+l) do l = l + 1 end
+            if l >= 4 or l > 0 and o+l > #target then
+                flush(o) num((l-1) << 2 | 0)
+                o = o + l
+                goto continue
+            end
+            if o+7 <= #target then
+                local p = index[unpack("<i8", target, o)]
+                if p then
+                    local m = 8
+                    while o+m <= #target and p+m <= #source and byte(source, p+m) == byte(target, o+m) do m = m + 1 end
+                    flush(o)
+                    local delta = p-1 - source_rel
+                    num((m-1) << 2 | 2) num(math.abs(delta) << 1 | (delta < 0 and 1 or 0))
+                    source_rel = p-1 + m
+                    o = o + m
+                    goto continue
+                end
+            end
+            literal = literal or o
+            o = o + 1
+            ::continue::
+        end
+        flush(o)
+        ins(s, string.pack("<I4I4", crc32(source), crc32(target)))
+        local patch = table.concat(s)
+        return patch .. string.pack("<I4", crc32(patch))
+    end,
+}
+-- writepatch(filename, source, target [, format])
+-- Write a patch turning binary string 'source' into 'target', which can also
+-- be a byte table, using specified format (defaults to IPS).
+M.writepatch = function(filename, source, target, format)
+    local clock = os.clock()
+    if type(target) == 'table' then
+        local data = {}
+        for i = 1, #target, 0x4000 do
+            data[#data+1] = string.char(table.unpack(target, i, math.min(i + 0x3fff, #target)))
+        end
+        target = table.concat(data)
+    end
+    local s = M.getpatch_as[format or 'ips'](source, target)
+    local f = assert(io.open(filename, "wb"), "failed to open " .. filename .. " for writing")
+    f:write(s) f:close()
+    stats.patch_size = #s
+    stats.patch_time = os.clock() - clock
+    return #s
+end
+
+-- Return a writer of lines into 'filename', buffered and flushed every few
+-- thousand lines. The file is only created once a line is written. Without
+-- 'filename', the lines are kept and close() returns them as a string.
+M.linewriter = function(filename)
+    local concat = table.concat
+    local buf,n,f,sep = {},0,nil,''
+    local flush = function()
+        if n == 0 then return end
+        if not f then f = assert(io.open(filename, "wb"), "failed to open " .. filename .. " for writing") end
+        f:write(sep, concat(buf, '\n', 1, n))
+        sep,n = '\n',0
+    end
+    return {
+        line = function(s) n=n+1 buf[n]=s if filename and n >= 4096 then flush() end end,
+        close = function()
+            if not filename then return concat(buf, '\n', 1, n) end
+            flush() if f then f:close() end
+        end,
+    }
 end
 
--- return a table of entry(address, label)
-M.getsym = function(entry)
-    local ins = table.insert
-    local s,sym_rev = {},{}
-    for k,v in pairs(symbols) do if type(v) == 'number' then ins(sym_rev,k) end end
-    table.sort(sym_rev, function(a,b) local x,y=symbols[a],symbols[b] if x==y then return a<b end return x<y end)
-    for _,v in ipairs(sym_rev) do
-        local k,vorg=symbols[v],v
-        local u=v:match'.*()_' if u then -- change _ to . in local labels
-            local parent=v:sub(1,u-1) if symbols[parent] then v = parent..'.'..v:sub(u+1) end
+-- Sorted index of the numeric symbols, by address then label: parallel arrays
+-- of addresses, debugger names (the last _ of local labels turned into a .)
+-- and original labels. Once resolve() has run, it is built only once.
+local symindex
+M.symindex = function()
+    if symindex then return symindex end
+    -- bucket labels by address, so that both sorts use plain comparisons
+    local byaddr,addrs = {},{}
+    for k,v in pairs(symbols) do if type(v) == 'number' then
+        local b = byaddr[v] if b then b[#b+1] = k else byaddr[v] = {k} addrs[#addrs+1] = v end
+    end end
+    table.sort(addrs)
+    local addr,name,label,n = {},{},{},0
+    for _,a in ipairs(addrs) do
+        local b = byaddr[a] if #b > 1 then table.sort(b) end
+        for _,v in ipairs(b) do
+            n=n+1 addr[n]=a label[n]=v
+            local u=v:match'.*()_' if u then -- change _ to . in local labels
+                local parent=v:sub(1,u-1) if symbols[parent] then v = parent..'.'..v:sub(u+1) end
+            end
+            name[n] = v
         end
-        local e = entry(k,v,vorg) if e then
-            if type(e) == 'table' then for _,ev in ipairs(e) do ins(s, ev) end
-            else ins(s, e) end
+    end
+    local index = { n=n, addr=addr, name=name, label=label }
+    if stats.resolved_count then symindex = index end
+    return index
+end
+
+-- Call entry(address, name, label) for each symbol of the index, in order.
+-- Non nil results, a line or a table of lines, are sent to 'out' if given, or
+-- else returned in a table.
+M.getsym = function(entry, out)
+    local s,line = {},out and out.line
+    if not line then line = function(e) s[#s+1] = e end end
+    local index = M.symindex()
+    local addr,name,label = index.addr,index.name,index.label
+    for i=1,index.n do
+        local e = entry(addr[i],name[i],label[i]) if e then
+            if type(e) == 'table' then for _,ev in ipairs(e) do line(ev) end
+            else line(e) end
         end
     end
     return s
 end
+-- Symbol file formats, called with the filename and a writer from
+-- linewriter(): they either write their lines into the writer, or return the
+-- whole file as a string. Without a writer, the lines are returned as a string.
 M.getsym_as = {
-    lua = function() -- .lua
-        local fmt,rep = string.format,string.rep
-        local s = M.getsym(function(a,l) return fmt("%s = 0x%04x", l, a) end)
-        return table.concat(s, '\n')
+    cycles = function(filename, out) -- best/worst case cycles of sections and basic blocks
+        if not stats.cycles_worst then M.genbin() end
+        local w = out or M.linewriter()
+        local fmt = string.format
+        w.line(fmt("%-24s %4s %5s %6s %6s", "; section/block", "addr", "size", "best", "worst"))
+        for _,section in ipairs(sections) do if section.blocks and section.size > 0 then
+            w.line(fmt("%-24s %04x %5d %6d %6d", section.label, section.location.rorg(section.org), section.size, section.cycles_best, section.cycles_worst))
+            for _,block in ipairs(section.blocks) do if block.size > 0 then
+                w.line(fmt("  %-22s %04x %5d %6d %6d", block.label, block.address, block.size, block.cycles_best, block.cycles_worst))
+            end end
+        end end
+        if not out then return w.close() end
+    end,
+    lua = function(filename, out) -- .lua
+        local w = out or M.linewriter()
+        local fmt = string.format
+        M.getsym(function(a,l) return fmt("%s = 0x%04x", l, a) end, w)
+        if not out then return w.close() end
     end,
-    dasm = function() -- .sym
+    dasm = function(filename, out) -- .sym
+        local w = out or M.linewriter()
         local fmt,rep = string.format,string.rep
-        local s = M.getsym(function(a,l) return fmt("%s%s %04x", l, rep(' ',24-#l), a) end)
-        table.insert(s, 1, '--- Symbol List')
-        s[#s+1] = '--- End of Symbol List.'
-        return table.concat(s, '\n')
+        w.line('--- Symbol List')
+        M.getsym(function(a,l) return fmt("%s%s %04x", l, rep(' ',24-#l), a) end, w)
+        w.line('--- End of Symbol List.')
+        if not out then return w.close() end
     end,
 }
 -- write a symbol file for debuggers, using specified format (defaults to DASM)
 M.writesym = function(filename, format)
     assert(filename)
-    local s = M.getsym_as[format or 'dasm'](filename)
-    if s then
-        local f = assert(io.open(filename, "wb"), "failed to open " .. filename .. " for writing")
-        f:write(s) f:close()
+    local out = M.linewriter(filename)
+    local s = M.getsym_as[format or 'dasm'](filename, out)
+    if s then out.line(s) end
+    out.close()
+end
+
+-- writedbg(filename [, binfile])
+-- Write a debug information file in the format of ca65/ld65 .dbg files: the
+-- source files, the source line and span of bytes of each instruction, one
+-- segment per location and the symbols, for source level debugging and
+-- profiling in emulators. Segments give their offset in 'binfile', the file
+-- written by writebin(). Instructions are placed as by genbin(), which is run
+-- first if needed.
+M.writedbg = function(filename, binfile)
+    assert(filename)
+    if not stats.bin_size then M.genbin() end
+    local fmt = string.format
+    local files,sources,lines,segs,spans = {},{},{},{},{}
+    local line_record = function(info, line)
+        local file = sources[info.source]
+        if not file then
+            local name = info.source:gsub('^@', '')
+            local attr = lfs and lfs.attributes(name)
+            file = { id=#files, name=name, size=attr and attr.size or 0, mtime=attr and attr.modification or 0, lines={} }
+            sources[info.source] = file
+            files[#files+1] = file
+        end
+        local record = file.lines[line]
+        if not record then
+            record = { id=#lines, file=file.id, line=line }
+            file.lines[line] = record
+            lines[#lines+1] = record
+        end
+        return record
     end
+    -- consecutive bytes of the same line make a single span
+    local last_record,last_span
+    local add_span = function(record, seg, start, size)
+        if record == last_record and last_span.seg == seg and last_span.start + last_span.size == start then
+            last_span.size = last_span.size + size
+            return
+        end
+        last_span = { id=#spans, seg=seg, start=start, size=size }
+        spans[#spans+1] = last_span
+        record[#record+1] = last_span.id
+        last_record = record
+    end
+    local labels = {}
+    local of0 = locations[1].start
+    for _,location in ipairs(locations) do
+        local seg = #segs
+        local size = location.finish and location.finish - location.start + 1 or 0
+        for _,section in ipairs(location.sections) do
+            local codes = section.codes or {}
+            if not location.finish then size = math.max(size, section.org + (section.size or 0) - location.start) end
+            for i,instruction in ipairs(section.instructions) do
+                local info = instruction.info
+                if info then
+                    local b = codes[i]
+                    local start = section.org + (instruction.offset or 0) - location.start
+                    if instruction.type == 'label' then
+                        labels[instruction.label] = { record=line_record(info, instruction.line), seg=seg }
+                    elseif instruction.blob or instruction.lines then
+                        for _,part in ipairs(instruction.blob or instruction.lines) do
+                            add_span(line_record(info, part.line), seg, start, part.size)
+                            start = start + part.size
+                        end
+                    elseif instruction.line then
+                        local n = type(b) == 'table' and #b or b and 1 or 0
+                        if n > 0 then add_span(line_record(info, instruction.line), seg, start, n) end
+                    end
+                end
+            end
+        end
+        segs[#segs+1] = fmt('seg\tid=%d,name="%s",start=0x%06X,size=0x%04X,addrsize=absolute,type=ro,%sooffs=%d',
+            seg, location.name or 'L' .. seg, location.rorg(location.start), size,
+            binfile and fmt('oname="%s",', binfile) or '', location.start - of0)
+    end
+    local syms,index = {},M.symindex()
+    for i=1,index.n do
+        local name,val = index.label[i],index.addr[i]
+        if math.type(val) == 'integer' and val >= 0 and val <= 0xffffffff then
+            local label = labels[name]
+            local addrsize = not label and val <= 0xff and 'zeropage' or 'absolute'
+            if label then
+                syms[#syms+1] = fmt('sym\tid=%d,name="%s",addrsize=%s,scope=0,def=%d,val=0x%X,seg=%d,type=lab',
+                    #syms, name, addrsize, label.record.id, val, label.seg)
+            else
+                syms[#syms+1] = fmt('sym\tid=%d,name="%s",addrsize=%s,scope=0,val=0x%X,type=equ', #syms, name, addrsize, val)
+            end
+        end
+    end
+
+    local out = M.linewriter(filename)
+    out.line('version\tmajor=2,minor=0')
+    out.line(fmt('info\tcsym=0,file=%d,lib=0,line=%d,mod=1,scope=1,seg=%d,span=%d,sym=%d,type=0',
+        #files, #lines, #segs, #spans, #syms))
+    for _,file in ipairs(files) do
+        out.line(fmt('file\tid=%d,name="%s",size=%d,mtime=0x%08X,mod=0', file.id, file.name, file.size, file.mtime))
+    end
+    for _,record in ipairs(lines) do
+        if #record > 0 then
+            out.line(fmt('line\tid=%d,file=%d,line=%d,span=%s', record.id, record.file, record.line, table.concat(record, '+')))
+        else
+            out.line(fmt('line\tid=%d,file=%d,line=%d', record.id, record.file, record.line))
+        end
+    end
+    out.line(fmt('mod\tid=0,name="%s",file=0', files[1] and files[1].name or ''))
+    out.line('scope\tid=0,name="",mod=0')
+    for _,seg in ipairs(segs) do out.line(seg) end
+    for _,span in ipairs(spans) do
+        out.line(fmt('span\tid=%d,seg=%d,start=%d,size=%d', span.id, span.seg, span.start, span.size))
+    end
+    for _,sym in ipairs(syms) do out.line(sym) end
+    out.line('') -- final newline
+    out.close()
+end
+
+-- writelst(filename)
+-- Write a listing of the sections placed by genbin(), which is run first if
+-- needed. Each instruction gets its address, bytes and cycles next to the
+-- source line it comes from. Cycles show the worst case extra as '+n',
+-- followed by 'p' when it comes from a page crossing. Each section ends
+-- with its size and cycles.
+M.writelst = function(filename)
+    assert(filename)
+    if not stats.bin_size then M.genbin() end
+    local fmt,unpack = string.format,table.unpack
+    local hexfmt = { '%02X', '%02X %02X', '%02X %02X %02X', '%02X %02X %02X %02X' }
+    local texts = {}
+    local source_text = function(source, line)
+        local text = texts[source]
+        if not text then
+            text = {}
+            local f = io.open((source:gsub('^@', '')), 'rb')
+            if f then for l in f:lines() do text[#text+1] = l:gsub('\r$', '') end f:close() end
+            texts[source] = text
+        end
+        return text[line] or ''
+    end
+    local out = M.linewriter(filename)
+    local cur_source,cur_line
+    -- the source line, only for the first instruction of a run of it
+    local source = function(info, line)
+        if not info or not line then return '' end
+        if info.source ~= cur_source then
+            cur_source,cur_line = info.source,nil
+            out.line('; ' .. info.source:gsub('^@', ''))
+        end
+        if line == cur_line then return '' end
+        cur_line = line
+        local text = source_text(cur_source, line)
+        return text == '' and fmt('%5d', line) or fmt('%5d  %s', line, text)
+    end
+    -- bytes b[first..first+size-1] at 'address', 4 per row
+    local code = function(address, b, first, size, cycles, text)
+        for i=first,first+size-1,4 do
+            local n = math.min(4, first+size-i)
+            local bytes = fmt(hexfmt[n], unpack(b, i, i+n-1))
+            if text ~= '' then out.line(fmt('%04X  %-11s  %-6s %s', address+i-first, bytes, cycles, text))
+            elseif cycles ~= '' then out.line(fmt('%04X  %-11s  %s', address+i-first, bytes, cycles))
+            else out.line(fmt('%04X  %s', address+i-first, bytes)) end
+            cycles,text = '',''
+        end
+    end
+    -- consecutive data of a same source line are listed together
+    local data,data_n,data_address,data_text = {},0
+    local data_flush = function()
+        if data_n > 0 then code(data_address, data, 1, data_n, '', data_text) data_n = 0 end
+    end
+    for _,location in ipairs(locations) do
+        local rorg = location.rorg
+        for _,section in ipairs(location.sections) do if section.size and section.size > 0 then
+            local codes,worsts = section.codes or {},section.worsts or {}
+            cur_source,cur_line = nil,nil
+            out.line(fmt('; section %s', section.label))
+            for i,instruction in ipairs(section.instructions) do
+                local b,info = codes[i],instruction.info
+                local address = rorg(section.org + (instruction.offset or 0))
+                if type(b) ~= 'table' then b = b and { b } or {} end
+                if instruction.data and not instruction.lines and data_n > 0 and address == data_address + data_n
+                    and info and info.source == cur_source and instruction.line == cur_line then
+                    table.move(b, 1, #b, data_n+1, data)
+                    data_n = data_n + #b
+                    goto continue
+                end
+                data_flush()
+                if instruction.type == 'label' then
+                    local text = source(info, instruction.line)
+                    if text ~= '' then out.line(fmt('%04X  %-11s  %-6s %s', address, '', '', text)) end
+                elseif instruction.blob then
+                    local first = 1
+                    for _,part in ipairs(instruction.blob) do
+                        code(address, b, first, part.size, tostring(part.cycles), source(info, part.line))
+                        first,address = first+part.size,address+part.size
+                    end
+                elseif instruction.lines then
+                    local first = 1
+                    for _,part in ipairs(instruction.lines) do
+                        code(address, b, first, part.size, '', source(info, part.line))
+                        first,address = first+part.size,address+part.size
+                    end
+                elseif #b > 0 then
+                    local cycles = instruction.cycles or 0
+                    local extra = (worsts[i] or cycles) - cycles
+                    local cross = instruction.rel and extra == 2 or instruction.xcross and instruction.xcross > 0 and extra > 0
+                    if instruction.data then
+                        data_text = source(info, instruction.line)
+                        table.move(b, 1, #b, 1, data)
+                        data_n,data_address = #b,address
+                    else
+                        if extra > 0 then cycles = fmt('%d+%d%s', cycles, extra, cross and 'p' or '')
+                        else cycles = tostring(cycles) end
+                        code(address, b, 1, #b, cycles, source(info, instruction.line))
+                    end
+                end
+                ::continue::
+            end
+            data_flush()
+            out.line(fmt('; %s: %d bytes, %d cycles, %d best, %d worst', section.label, section.size,
+                section.cycles or 0, section.cycles_best or 0, section.cycles_worst or 0))
+            out.line('')
+        end end
+    end
+    out.close()
 end
 
 stats.__tostring = function()
@@ -430,6 +2032,19 @@ stats.__tostring = function()
     if #locations > 1 then
         ins(s, string.format(" --- Total ---  %5d %5d %5d", stats.unused, stats.used, stats.bin_size))
     end
+    if stats.profile_saved and stats.profile_saved > 0 then
+        ins(s, string.format("Profile placement saves %.1f cycles per %s", stats.profile_saved / (stats.profile_frames or 1),
+            stats.profile_frames and "frame" or "run"))
+    end
+    if #ram_vars > 0 then
+        ins(s, string.format("ram_var() placement: %d bytes fast, %d bytes slow", stats.ram_fast, stats.ram_slow))
+    end
+    if #ram_locals > 0 then
+        local depths = {}
+        for name,depth in pairs(stats.stack_depth) do table.insert(depths, name .. " " .. (depth or "recursive")) end
+        table.sort(depths)
+        ins(s, string.format("ram_local() overlay: %d bytes, stack depth: %s", stats.locals_peak, table.concat(depths, ", ")))
+    end
     return table.concat(s, '\n')
 end
 
@@ -463,6 +2078,23 @@ M.location = function(start, finish)
     return location
 end
 
+-- Record the source position of the instructions appended to a section: the
+-- 'line' of the innermost caller outside the embedded modules, whose chunk
+-- names start with '=', and its source in 'info', shared by the whole file.
+local source_infos = {}
+local instructions_mt = { __newindex = function(instructions, i, instruction)
+    if type(instruction) == 'table' and not instruction.info then
+        local level,info = 3
+        repeat info = debug.getinfo(level, 'Sl') level = level+1 until not info or info.source:sub(1,1) ~= '='
+        if info then
+            local source = info.source
+            if not source_infos[source] then source_infos[source] = { source=source, short_src=info.short_src } end
+            instruction.info,instruction.line = source_infos[source],info.currentline
+        end
+    end
+    rawset(instructions, i, instruction)
+end }
+
 M.section = function(t)
     local section = {}
     local name = t or 'S'..id()
@@ -486,15 +2118,17 @@ M.section = function(t)
     section.type = 'section'
     section.id = id()
     section.constraints = {}
-    section.instructions = {}
+    section.instructions = setmetatable({}, instructions_mt)
     assert(name:sub(1,1) ~= '_', "sections can't be named with a local label")
     section.label = M.label(name)
     section.holes = {}
     section.refcount = 0
+    section.refs = {}
     function section:compute_size()
         local instructions = self.instructions
+        local sizes,relax = {}
         self.size=0 self.cycles=0
-        for _,instruction in ipairs(instructions) do
+        for i,instruction in ipairs(instructions) do
             instruction.offset = self.size
             local ins_sz = instruction.size or 0
             if type(ins_sz) == 'function' then
@@ -504,8 +2138,49 @@ M.section = function(t)
                 -- in that case, assume max size
                 ins_sz = ins_sz()
             end
+            sizes[i] = ins_sz
             self.size = self.size + ins_sz
+            if instruction.relax then relax = true end
+        end
+        local relaxing,padded = relax
+        local move = function()
+            self.size = 0
+            for i,instruction in ipairs(instructions) do
+                instruction.offset = self.size
+                self.size = self.size + sizes[i]
+            end
+        end
+        repeat
+            -- branches start in their shortest form: promote those whose
+            -- target is out of range, and move the following instructions,
+            -- until none grows anymore
+            while relax do
+                relax = false
+                for i,instruction in ipairs(instructions) do
+                    if instruction.relax and instruction.relax() then
+                        sizes[i] = instruction.size
+                        stats.relaxed = stats.relaxed + 1
+                        relax = true
+                    end
+                end
+                if relax then move() end
+            end
+            -- cycle padding counts the relaxed branches; since branches only
+            -- grow, padding only shrinks and this settles
+            padded = false
+            if relaxing then
+                for i,instruction in ipairs(instructions) do
+                    if instruction.pad then
+                        local size = instruction.pad()
+                        if size ~= sizes[i] then sizes[i],padded = size,true end
+                    end
+                end
+                if padded then move() relax = true end
+            end
+        until not padded
+        for _,instruction in ipairs(instructions) do
             self.cycles = self.cycles + (instruction.cycles or 0)
+            if instruction.hole then instruction.hole.start = instruction.offset end
         end
         for _,constraint in ipairs(self.constraints) do
             constraint.start = instructions[constraint.from].offset
@@ -534,9 +2209,8 @@ M.relate = function(section1, section2, offset, offset2)
 end
 
 M.label = function(name)
-    local label,offset
     local section,rorg = M.section_current,M.location_current.rorg
-    label = { type='label', section=section }
+    local label = { type='label', section=section }
     if not name then name='_L'..id() end
     if name:sub(1,1) == '_' then -- local label
         name = M.label_current .. name
@@ -548,12 +2222,11 @@ M.label = function(name)
     symbols[name] = label
     label.label = name
     label.size = function()
-        offset = section.size
         label.size = 0
         return 0
     end
     label.resolve = function()
-        local o = section.org + offset
+        local o = section.org + label.offset
         return rorg(o),o
     end
     table.insert(section.instructions, label)
@@ -570,21 +2243,67 @@ M.crosspage = function()
 end
 M.endpage = function()
     local section = M.section_current
-    local constraint = section.constraints[#section.constraints]
-    assert(constraint and not constraint.to, "closing constraint, but no constraint is open")
+    local constraints,constraint = section.constraints
+    -- close the innermost open constraint, so that blocks can be nested
+    for i=#constraints,1,-1 do if not constraints[i].to then constraint = constraints[i] break end end
+    assert(constraint, "closing constraint, but no constraint is open")
+    if constraint.pad then M.cycles_pad(constraint) end
     constraint.to = #section.instructions
 end
 
+-- cycles_exact(cycles [, pad [, noillegal]]) ... endpage()
+-- Open a block of instructions which must execute in exactly 'cycles'
+-- cycles, on every path through its branches and whatever the page
+-- crossings, checked by genbin against the final addresses. If 'pad' is true, the block is completed up
+-- to 'cycles' the same way as sleep does.
+M.cycles_exact = function(cycles, pad, noillegal)
+    local section = M.section_current
+    table.insert(section.constraints, { type='cycles_exact', cycles=cycles, pad=pad, noillegal=noillegal,
+        from=#section.instructions+1, info=debug.getinfo(2, 'Sl') })
+end
+-- cycles_max(cycles) ... endpage()
+-- Open a block of instructions which must execute in at most 'cycles'
+-- cycles on its longest path, checked by genbin.
+M.cycles_max = function(cycles)
+    local section = M.section_current
+    table.insert(section.constraints, { type='cycles_max', cycles=cycles,
+        from=#section.instructions+1, info=debug.getinfo(2, 'Sl') })
+end
+-- Append to the current section the cheapest instructions completing the
+-- block of 'constraint' to its cycle count, once the cycle count of the
+-- other instructions is known during link phase.
+M.cycles_pad = function(constraint)
+    local section,ins = M.section_current,{ cycles=0 }
+    ins.pad = function()
+        local cycles = constraint.cycles
+        -- the padding instruction is the last one of the block
+        for i=constraint.from,constraint.to-1 do cycles = cycles - (section.instructions[i].cycles or 0) end
+        if cycles < 0 or cycles == 1 then
+            error(string.format("%s: can't pad %s(%d) block by %d cycles", source_line(constraint.info), constraint.type, constraint.cycles, cycles), 0)
+        end
+        local b = {}
+        ins.cycles = cycles
+        if cycles & 1 ~= 0 then
+            b[1] = constraint.noillegal and M.opzpg.bit.opc or M.opzpg.nop.opc b[2] = 0
+            cycles = cycles - 3
+        end
+        for i=1,cycles//2 do b[#b+1] = M.opimp.nop.opc end
+        ins.bin = b
+        ins.size = #b
+        return #b
+    end
+    ins.size = ins.pad
+    table.insert(section.instructions, ins)
+end
+
 -- skip(bytes)
 -- Insert a hole in the section of 'bytes' bytes, which can be used by other
 -- relocatable sections.
 M.skip = function(bytes)
     local l65dbg = { info=debug.getinfo(2, 'Sl'), trace=debug.traceback(nil, 1) }
-    local ins,section = {},M.section_current
-    ins.size = function()
-        table.insert(section.holes, { start=ins.offset, size=bytes })
-        return bytes
-    end
+    local ins,section = { size=bytes, hole={ size=bytes } },M.section_current
+    -- its start is set by compute_size() from the final offsets
+    table.insert(section.holes, ins.hole)
     ins.bin = function(filler) return nil,bytes end
     table.insert(section.instructions, ins)
 end
@@ -600,24 +2319,412 @@ M.sleep = function(cycles, noillegal)
     for i=1,cycles/2 do nopimp() end
 end
 
+-- blob_capture(f, ...)
+-- Call the instruction emitter 'f' with constant operands into a scratch
+-- section, and return the bytes, as a string, and cycles of the single
+-- instruction it emits. Return nothing when the encoding depends on link
+-- time state: labels, relaxation, page crossing, calls, stack and flow
+-- changes, or a mode missing from 'blob_modes'.
+local blob_encode = function(f, ...)
+    local scratch = { instructions={}, constraints={}, holes={} }
+    M.section_current = scratch
+    f(...)
+    local ins = scratch.instructions[1]
+    if #scratch.instructions ~= 1 or #scratch.constraints > 0 or #scratch.holes > 0 then return end
+    if ins.type or ins.data or ins.target or ins.rel or ins.relax or ins.cycles_worst or (ins.xcross or 0) > 0 then return end
+    if ins.mode and not M.blob_modes[ins.mode] then return end
+    if ins.op and (M.call_ops and M.call_ops[ins.op] or M.stack_ops[ins.op]) then return end
+    local size,b,cycles = ins.size,ins.bin,ins.cycles or 0
+    if type(size) == 'function' then size = size() end
+    if type(b) == 'function' then b = b() end
+    if type(b) == 'number' then b = { b } end
+    if type(b) ~= 'table' or #b ~= size or math.type(cycles) ~= 'integer' then return end
+    if M.opflow and M.opflow[b[1]] then return end
+    return string.char(table.unpack(b)),cycles
+end
+M.blob_capture = function(f, ...)
+    local current,env = M.section_current,getmetatable(_ENV)
+    -- CPU modules reach the asm functions through the script environment
+    if not env then setmetatable(_ENV, M) end
+    -- on a stack of its own, so that the debug traceback of the instruction
+    -- does not walk the frames of the formatter
+    local r,code,cycles = coroutine.resume(coroutine.create(blob_encode), f, ...)
+    if not env then setmetatable(_ENV, nil) end
+    M.section_current = current
+    if r then return code,cycles end
+end
+
+-- __blob(env, line, name, operands, bytes, cycles, ...)
+-- Emit a run of instructions pre-encoded by the formatter as a single one,
+-- given the source line, opcode name, operands as Lua source, bytes and
+-- cycles of each. Its 'blob' field keeps the parts apart for peephole(),
+-- cycles_budget() and diagnostics. An opcode whose function in 'env' is no
+-- longer the one of the CPU module is called instead, with its operands.
+M.__blob = function(env, ...)
+    local args,info = table.pack(...),debug.getinfo(2, 'S')
+    local bin,cycles,blob = {},0,{}
+    local flush = function()
+        if #blob == 0 then return end
+        table.insert(M.section_current.instructions, { size=#bin, cycles=cycles, bin=bin, blob=blob, info=info })
+        bin,cycles,blob = {},0,{}
+    end
+    for i=1,args.n,5 do
+        local line,name,operands,code,n = args[i],args[i+1],args[i+2],args[i+3],args[i+4]
+        local f = env[name]
+        if f ~= rawget(M, name) then
+            flush()
+            f(load("return " .. operands, "=__blob", "t", env)())
+        else
+            table.move({ code:byte(1, -1) }, 1, #code, #bin+1, bin)
+            table.insert(blob, { line=line, size=#code, cycles=n })
+            cycles = cycles + n
+        end
+    end
+    flush()
+end
+
+-- Operands of numbers and global names combined by integer arithmetic are
+-- built by the parsers as expression nodes rather than closures: a leaf
+-- { type='expr', env=env, name=name } per global name, and operator nodes
+-- { type='expr', op=op, a, b } made by the metamethods, so that arithmetic
+-- over numbers only is folded by Lua itself. Evaluating a node does not
+-- raise errors, and its value is kept once resolve() has run.
+local expr_mt = {}
+local is_expr = function(v) return type(v) == 'table' and v.type == 'expr' end
+M.is_expr = is_expr
+local expr_node = function(op, a, b) return setmetatable({ type='expr', op=op, a, b }, expr_mt) end
+for op,event in pairs{ ['+']='__add', ['-']='__sub', ['*']='__mul', ['//']='__idiv', ['%']='__mod',
+        ['&']='__band', ['|']='__bor', ['~']='__bxor', ['<<']='__shl', ['>>']='__shr' } do
+    expr_mt[event] = function(a, b) return expr_node(op, a, b) end
+end
+expr_mt.__unm = function(a) return expr_node('neg', a) end
+expr_mt.__bnot = function(a) return expr_node('bnot', a) end
+local expr_ops = {
+    ['+']=function(a,b) return a+b end, ['-']=function(a,b) return a-b end, ['*']=function(a,b) return a*b end,
+    ['//']=function(a,b) return a//b end, ['%']=function(a,b) return a%b end, ['&']=function(a,b) return a&b end,
+    ['|']=function(a,b) return a|b end, ['~']=function(a,b) return a~b end, ['<<']=function(a,b) return a<<b end,
+    ['>>']=function(a,b) return a>>b end, neg=function(a) return -a end, bnot=function(a) return ~a end,
+}
+
+-- __ref(env, name)
+-- Return the expression node of global 'name' of 'env', looked up when it is
+-- evaluated. Names starting with an underscore are taken as local labels
+-- under the current label, unless 'env' has a global of that name. Nodes of
+-- the same name are shared, so their value is resolved once.
+local expr_refs = setmetatable({}, { __mode='k' })
+M.__ref = function(env, name)
+    local key = name
+    if name:sub(1,1) == '_' and M.label_current then key = M.label_current .. name end
+    local refs = expr_refs[env]
+    if not refs then refs = {} expr_refs[env] = refs end
+    local e = refs[key]
+    if not e then
+        e = setmetatable({ type='expr', env=env, name=key, global=key ~= name and name or nil }, expr_mt)
+        refs[key] = e
+    end
+    return e
+end
+
+-- Return the value of the name of leaf node 'e' in its environment.
+local expr_leaf = function(e)
+    local v = e.global and rawget(e.env, e.global)
+    if v == nil then v = e.env[e.name] end
+    return v
+end
+
+-- Return the value of expression node 'e', or nil and the name of a symbol
+-- which does not resolve yet. Names resolve as op_resolve() does, with the
+-- references of every name counted for the section being sized.
+local expr_value
+expr_value = function(e)
+    local v = e.value
+    if v then return v end
+    local name = e.name
+    if name then
+        v = expr_leaf(e)
+        if type(v) == 'function' then v = v() end
+        if M.section_sizing then M.size_ref(v) end
+        if type(v) == 'table' and v.label then v = symbols[v.label] end
+        if type(v) == 'string' then v = symbols[v] end
+        if type(v) ~= 'number' then return nil,name end
+    else
+        local a,b,ua,ub = e[1],e[2]
+        if type(a) == 'table' then a,ua = expr_value(a) end
+        if type(b) == 'table' then b,ub = expr_value(b) end
+        if ua or ub then return nil,ua or ub end
+        v = expr_ops[e.op](a, b)
+    end
+    if stats.resolved_count then e.value = v end
+    return v
+end
+
+-- Return the value of expression node 'e' with the value of each name
+-- mapped by 'leaf', which may raise errors.
+local expr_apply
+expr_apply = function(e, leaf)
+    if e.name then return leaf(expr_leaf(e)) end
+    local a,b = e[1],e[2]
+    if type(a) == 'table' then a = expr_apply(a, leaf) end
+    if type(b) == 'table' then b = expr_apply(b, leaf) end
+    return expr_ops[e.op](a, b)
+end
+M.expr_apply = expr_apply
+
 local op_resolve = function(v)
+    if is_expr(v) then
+        local x,name = expr_value(v)
+        if not x then error("unresolved symbol: " .. name) end
+        return x
+    end
     if type(v) == 'function' then v=v() end
+    if M.section_sizing then M.size_ref(v) end
     if type(v) == 'table' and v.label then v = symbols[v.label] end
     if type(v) == 'string' then v = symbols[v] end
     if type(v) ~= 'number' then error("unresolved symbol: " .. tostring(v)) end
     return v
 end M.op_resolve = op_resolve
 
+-- Count a reference to the section of label or section 'v', and record it
+-- into the 'refs' of the section being sized, if any.
 local size_ref = function(v)
     if type(v) == 'string' then v=symbols[v] end
-    if type(v) == 'table' and v.type == 'label' then v.section.refcount = 1 + (v.section.refcount or 0) end
+    if type(v) ~= 'table' then return end
+    local section
+    if v.type == 'label' then section = v.section elseif v.type == 'section' then section = v end
+    if not section then return end
+    section.refcount = 1 + (section.refcount or 0)
+    local from = M.section_sizing
+    if from and from ~= section then from.refs[section] = true end
 end
 M.size_ref = size_ref
 
+-- find_label(v, parent)
+-- Return the label table of 'v', a label, a section, a label name or a local
+-- label name under 'parent', if it is one.
+local find_label = function(v, parent)
+    if type(v) == 'table' and v.type == 'section' then v = v.label end
+    if type(v) == 'string' then
+        if v:sub(1,1) == '_' then
+            if not parent then return end
+            v = parent .. v
+        end
+        v = rawget(symbols, v)
+    end
+    if type(v) == 'table' and v.type == 'label' then return v end
+end
+M.find_label = find_label
+
+-- snippet(f)
+-- Assemble the instructions emitted by 'f()' on their own, as a section at
+-- the start of the current location which is then discarded, and return
+-- the bytes and their CPU address. Operands must resolve without link.
+M.snippet = function(f)
+    local location,section_current,label_current = M.location_current,M.section_current,M.label_current
+    local refcounts,relaxed = {},stats.relaxed
+    for _,section in ipairs(sections) do refcounts[section] = section.refcount end
+    local section = M.section()
+    table.remove(location.sections)
+    table.remove(sections)
+    local ok,err = pcall(f)
+    local labels = {}
+    for _,instruction in ipairs(section.instructions) do
+        if instruction.type == 'label' then table.insert(labels, instruction) end
+    end
+    local bytes = {}
+    if ok then
+        stats.relaxed = 0
+        ok,err = pcall(function()
+            section:compute_size()
+            section.org = location.start
+            for _,label in ipairs(labels) do symbols[label.label] = location.rorg(section.org + label.offset) end
+            for _,instruction in ipairs(section.instructions) do
+                local b,o = instruction.bin
+                if type(b) == 'function' then b,o = b(M.bin_filler) end
+                if type(b) == 'table' then table.move(b, 1, #b, #bytes+1, bytes) elseif b then table.insert(bytes, b) end
+                for i=1,o or 0 do table.insert(bytes, M.bin_filler) end
+            end
+        end)
+    end
+    for _,label in ipairs(labels) do symbols[label.label] = nil end
+    for section,refcount in pairs(refcounts) do section.refcount = refcount end
+    stats.relaxed = relaxed
+    M.location_current,M.section_current,M.label_current = location,section_current,label_current
+    if not ok then error(err, 0) end
+    return bytes,location.rorg(location.start)
+end
+
+-- fastest(candidates, setup [, name])
+-- Simulate each of the 'candidates', functions emitting code or the names
+-- of such global functions, after 'setup(sim)', emit the one taking the
+-- fewest cycles, and return its index and the cycles of each candidate.
+M.fastest = function(candidates, setup, name)
+    if not M.simulator then error("no cycle simulator for this CPU") end
+    if stats.resolved_count then error("fastest() emits code, it must be called before link") end
+    local results,best = {}
+    for i,candidate in ipairs(candidates) do
+        local f = type(candidate) == 'string' and _ENV[candidate] or candidate
+        if type(f) ~= 'function' then error("fastest candidate is not a function: " .. tostring(candidate)) end
+        local bytes,address = M.snippet(f)
+        local sim = M.simulator()
+        table.move(sim.ret, 1, #sim.ret, #bytes+1, bytes)
+        for j,b in ipairs(bytes) do sim.mem[address+j-1] = b end
+        if setup then setup(sim) end
+        results[i] = sim:call(address) - sim.ret_cycles
+        if not best or results[i] < results[best] then best = i end
+    end
+    local section = M.section_current
+    local first = #section.instructions + 1
+    local f = candidates[best]
+    if type(f) == 'string' then f = _ENV[f] end
+    f()
+    local names = {}
+    for i,candidate in ipairs(candidates) do names[i] = type(candidate) == 'string' and candidate or '#' .. i end
+    table.insert(benchmarks, { type='fastest', label=name, names=names, cycles=results, best=best,
+        section=section, instruction=section.instructions[first], source=source_line(debug.getinfo(2, 'Sl')) })
+    return best,results
+end
+
+-- label_offset(v, parent, section)
+-- Return the offset within 'section' of the label 'v', a label, a label name
+-- or a local label name under 'parent', as of the current sizing pass. Return
+-- nothing if the label is in another section, so its distance is unknown
+-- until link phase.
+M.label_offset = function(v, parent, section)
+    local label = find_label(v, parent)
+    if label and label.section == section then return label.offset end
+end
+
+-- label_next(label)
+-- Return the first instruction following 'label' which is not a label.
+M.label_next = function(label)
+    local instructions = label.section.instructions
+    for i,instruction in ipairs(instructions) do if instruction == label then
+        for j=i+1,#instructions do
+            if instructions[j].type ~= 'label' then return instructions[j] end
+        end
+        return
+    end end
+end
+
+-- op_key(late, early, parent)
+-- Evaluate the operand of an instruction under label 'parent' before link
+-- phase, for peephole rules to compare operands. Return its value when it is
+-- a constant, or a unique key and the label when it is exactly a label;
+-- nothing otherwise.
+local label_keys,key_labels = {},{}
+M.op_key = function(late, early, parent)
+    local labeled
+    local key = function(v)
+        if type(v) == 'number' then return v end
+        local label = find_label(v, parent)
+        if not label then error("not a label") end
+        if not label_keys[label] then
+            local k = id() << 32
+            label_keys[label],key_labels[k] = k,label
+        end
+        labeled = true
+        return label_keys[label]
+    end
+    local mt = getmetatable(symbols)
+    setmetatable(symbols, { __index = function(tab,key)
+        if type(key) == 'string' and key:sub(1,1) == '_' and parent then return rawget(symbols, parent .. key) end
+    end })
+    local r,v = pcall(function()
+        if is_expr(late) then return expr_apply(late, key) + (early or 0) end
+        if type(late) == 'function' then return late(early or 0, key) end
+        return key(late) + (early or 0)
+    end)
+    setmetatable(symbols, mt)
+    if not r or math.type(v) ~= 'integer' then return end
+    if labeled then
+        if not key_labels[v] then return end
+        return v,key_labels[v]
+    end
+    return v
+end
+
+-- Replace the __blob() runs of 'section' by one instruction per part, with
+-- its constant 'code', and the fields the CPU 'blob_decode' adds from it.
+local blob_split = function(section)
+    local instructions,i = section.instructions,1
+    while i <= #instructions do
+        local instruction = instructions[i]
+        if instruction.blob then
+            local offset,n = 0,#instruction.blob
+            table.remove(instructions, i)
+            for j,part in ipairs(instruction.blob) do
+                local code = table.move(instruction.bin, offset+1, offset+part.size, 1, {})
+                local ins = { size=part.size, cycles=part.cycles, code=code, bin=code, line=part.line, info=instruction.info }
+                if M.blob_decode then M.blob_decode(ins) end
+                table.insert(instructions, i+j-1, ins)
+                offset = offset + part.size
+            end
+            for _,constraint in ipairs(section.constraints) do
+                if constraint.from > i then constraint.from = constraint.from+n-1 end
+                if constraint.to >= i then constraint.to = constraint.to+n-1 end
+            end
+            i = i+n
+        else i = i+1 end
+    end
+end
+
+-- peephole(section)
+-- Apply the CPU 'peephole_rules' to the instructions of 'section' until none
+-- applies. A rule is called with the instructions, the index of one, the
+-- index of the last one of the run it belongs to, and the current non-local
+-- label name. Runs are made of consecutive instructions described by an 'op'
+-- or a constant 'code', so labels and other instructions are barriers, and
+-- instructions within constraints are left untouched. A rule which applies
+-- returns the index of the first instruction to replace within the run,
+-- their count, the bytes and cycles saved, and the replacement instructions.
+M.peephole = function(section)
+    blob_split(section)
+    local instructions,rules = section.instructions,M.peephole_rules
+    local fixed = {}
+    for _,constraint in ipairs(section.constraints) do
+        for i=constraint.from,constraint.to do fixed[instructions[i]] = true end
+    end
+    local plain = function(instruction)
+        return instruction and not fixed[instruction] and instruction.type ~= 'label' and (instruction.op or instruction.code)
+    end
+    local apply = function(from, count, bytes, cycles, ...)
+        local replacements = table.pack(...)
+        for _=1,count do table.remove(instructions, from) end
+        for j=1,replacements.n do table.insert(instructions, from+j-1, replacements[j]) end
+        local delta = replacements.n - count
+        for _,constraint in ipairs(section.constraints) do
+            if constraint.from > from then constraint.from,constraint.to = constraint.from+delta,constraint.to+delta end
+        end
+        stats.peephole_bytes = (stats.peephole_bytes or 0) + bytes
+        stats.peephole_cycles = (stats.peephole_cycles or 0) + cycles
+    end
+    local i,parent = 1
+    while i <= #instructions do
+        local instruction = instructions[i]
+        if instruction.type == 'label' and instruction.bin then parent = instruction.label end
+        if plain(instruction) then
+            local last = i
+            while plain(instructions[last+1]) do last = last+1 end
+            for _,rule in ipairs(rules) do
+                local r = table.pack(rule(instructions, i, last, parent))
+                if r[1] then
+                    apply(table.unpack(r, 1, r.n))
+                    -- replaced instructions may enable rules on earlier ones
+                    while plain(instructions[i-1]) do i = i-1 end
+                    goto continue
+                end
+            end
+        end
+        i = i+1
+        ::continue::
+    end
+end
+
 local size_dc = function(v)
     if type(v) == 'function' then
         local r,x = M.pcall(v)
         if not r or not x then return v end
+        size_ref(x)
     end
     size_ref(v)
     return v
@@ -625,6 +2732,11 @@ end
 M.size_dc = size_dc
 
 local size_op = function(late, early)
+    if is_expr(late) then
+        local r,x = M.pcall(expr_value, late)
+        if not r or not x then return late,early end
+        return x + (early or 0)
+    end
     if type(late) == 'function' then
         local r,x = M.pcall(late, early or 0, op_resolve)
         if not r or not x then return late,early end
@@ -724,6 +2836,28 @@ end
 M.byte = function(...)
     return M.byte_impl({...}, byte_normalize)
 end
+-- __bytes(s [, lines])
+-- Declare the bytes of string 's' to go into the binary stream, as byte()
+-- of constant values. The formatters compile runs of constant dc.b data into
+-- it, kept as a single string until the binary is generated. 'lines' lists
+-- the source line and size of each line of the run, { line, size, ... }, for
+-- the listing and debug info.
+M.__bytes = function(s, lines)
+    local bin = function()
+        local b = {}
+        for i=1,#s,0x4000 do
+            local chunk = { s:byte(i, i+0x3fff) }
+            table.move(chunk, 1, #chunk, i, b)
+        end
+        return b
+    end
+    local parts
+    if lines then
+        parts = {}
+        for i=1,#lines,2 do table.insert(parts, { line=lines[i], size=lines[i+1] }) end
+    end
+    table.insert(M.section_current.instructions, { data=s, size=#s, bin=bin, lines=parts })
+end
 local byte_encapsulate = function(args)
     for k,v in ipairs(args) do
         local vt = type(v)
@@ -829,4 +2963,18 @@ local op_eval = function(late, early)
 end
 M.op_eval = op_eval
 
+-- op_try(late, early)
+-- Return true and the value of an operand when it resolves, through
+-- M.pcall_za, as the sizing of instructions choosing between zero page and
+-- absolute addressing does. Expression nodes which do not resolve yet are
+-- told apart without raising an error.
+M.op_try = function(late, early)
+    if is_expr(late) then
+        local r,x = M.pcall_za(expr_value, late)
+        if not r or not x then return false end
+        return true,x + (early or 0)
+    end
+    return M.pcall_za(op_eval, late, early)
+end
+
 return M
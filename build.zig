@@ -49,8 +49,10 @@ pub fn build(b: *std.Build) !void {
     embed.addFileArg(b.path("6502.lua"));
     embed.addFileArg(b.path("dkjson.lua"));
     embed.addFileArg(b.path("l65.lua"));
+    embed.addFileArg(b.path("lfront.lua"));
     embed.addFileArg(b.path("pb.lua"));
     embed.addFileArg(b.path("re.lua"));
+    embed.addFileArg(b.path("sim6502.lua"));
     embed.addFileArg(b.path("nes.l65"));
     embed.addFileArg(b.path("pce.l65"));
     embed.addFileArg(b.path("vcs.l65"));
@@ -62,6 +64,7 @@ pub fn build(b: *std.Build) !void {
     embed_7801.addFileArg(b.path("uPD7801.lua"));
     embed_7801.addFileArg(b.path("dkjson.lua"));
     embed_7801.addFileArg(b.path("l7801.lua"));
+    embed_7801.addFileArg(b.path("lfront.lua"));
     embed_7801.addFileArg(b.path("l65cfg.lua"));
     embed_7801.addFileArg(b.path("pb.lua"));
     embed_7801.addFileArg(b.path("re.lua"));
@@ -74,9 +77,11 @@ pub fn build(b: *std.Build) !void {
     embed_z80.addFileArg(b.path("z80.lua"));
     embed_z80.addFileArg(b.path("dkjson.lua"));
     embed_z80.addFileArg(b.path("lz80.lua"));
+    embed_z80.addFileArg(b.path("lfront.lua"));
     embed_z80.addFileArg(b.path("l65cfg.lua"));
     embed_z80.addFileArg(b.path("pb.lua"));
     embed_z80.addFileArg(b.path("re.lua"));
+    embed_z80.addFileArg(b.path("simsm83.lua"));
     embed_z80.addFileArg(b.path("gb.lz80"));
     embed_z80.addFileArg(b.path("hUGEDriver.lz80"));
 
@@ -192,6 +192,8 @@ int main(int argc, char *argv[])
     lua_setfield(L, -2, "asm");
     luaL_loadbufferx(L, script_uPD7801_lua, sizeof(script_uPD7801_lua), "uPD7801.lua", "b");
     lua_setfield(L, -2, "uPD7801");
+    luaL_loadbufferx(L, script_lfront_lua, sizeof(script_lfront_lua), "lfront.lua", "b");
+    lua_setfield(L, -2, "lfront");
     lua_pop(L, 1);
 
     // error handler
@@ -0,0 +1,2532 @@
+-- Front end shared by the l65, lz80 and l7801 parsers: the lexer and the
+-- parser of Lua and of the statements common to the CPUs, and the formatter
+-- of their AST into Lua source, with its pre-encoded runs and constant data.
+-- Each parser only keeps the tables, pragmas and opcode statements of its CPU,
+-- passed as the hooks of its 'syntax', see parser() and formatter().
+
+local M = {}
+
+local function lookupify(tb, dst, not_val)
+    if not dst then dst = tb end
+    local val = not not_val
+    for _, v in pairs(tb) do
+        dst[v] = val
+    end
+    return tb
+end
+M.lookupify = lookupify
+
+-- Lexical scopes of the parsers. Variables are also indexed by name, since
+-- every global reference looks up all the enclosing scopes.
+local Scope = {
+    new = function(self, parent)
+        local s = {
+            Parent = parent,
+            Locals = { },
+            Globals = { },
+            Children = { },
+            LocalNames = { },
+            GlobalNames = { },
+        }
+
+        if parent then
+            table.insert(parent.Children, s)
+        end
+
+        return setmetatable(s, { __index = self })
+    end,
+
+    AddLocal = function(self, v)
+        table.insert(self.Locals, v)
+        if not self.LocalNames[v.Name] then self.LocalNames[v.Name] = v end
+    end,
+
+    AddGlobal = function(self, v)
+        table.insert(self.Globals, v)
+        if not self.GlobalNames[v.Name] then self.GlobalNames[v.Name] = v end
+    end,
+
+    CreateLocal = function(self, name)
+        local v
+        v = self:GetLocal(name)
+        if v then return v end
+        v = { }
+        v.Scope = self
+        v.Name = name
+        v.IsGlobal = false
+        self:AddLocal(v)
+        return v
+    end,
+
+    GetLocal = function(self, name)
+        repeat
+            local v = self.LocalNames[name]
+            if v then return v end
+            self = self.Parent
+        until not self
+    end,
+
+    CreateGlobal = function(self, name)
+        local v
+        v = self:GetGlobal(name)
+        if v then return v end
+        v = { }
+        v.Scope = self
+        v.Name = name
+        v.IsGlobal = true
+        self:AddGlobal(v)
+        return v
+    end,
+
+    GetGlobal = function(self, name)
+        repeat
+            local v = self.GlobalNames[name]
+            if v then return v end
+            self = self.Parent
+        until not self
+    end,
+}
+
+-- opcode_peek(tok, opcodes)
+-- Return a list of the opcode the next token is, if it is a keyword of the
+-- 'opcodes' set, or an empty list, for the opcode loop of the parsers to
+-- dispatch on instead of trying each opcode keyword in turn.
+local no_opcode = {}
+M.opcode_peek = function(tok, opcodes)
+    local t = tok:Peek()
+    if t.Type == 'Keyword' and opcodes[t.Data] then return { t.Data } end
+    return no_opcode
+end
+
+-- Lexer and statement parser of the l65, lz80 and l7801 syntaxes: Lua with
+-- labels, page and data statements, and the opcodes of the CPU, whose
+-- 'syntax' provides:
+--   keywords          the keyword set, Lua keywords plus the opcodes while
+--                     the CPU syntax is on
+--   on()              whether the CPU syntax is on
+--   operators         the symbols of its operator syntax, lexed when on
+--   postfix(token)    optional, whether a '--' right after 'token' is a
+--                     decrement rather than a comment
+--   pragma(name, word, onoff, error)
+--                     the token of '#pragma name', or nothing if unknown
+--   pragmas           the statement keywords emitted by its pragmas
+--   encapsulate()     whether opcode operands are encapsulated by default
+--   statement(p)      parse an opcode statement, given the parser state 'p',
+--                     returning true and the statement or nothing, or false
+--                     and an error
+--   keyword_idents    keywords which are not Lua keywords are identifiers
+--   bracket_operands  a '[' beginning a line starts an operand
+--   operand_expr      operands are passed as expressions when they can be,
+--                     see operand_expr()
+
+local Spaces = lookupify{' ', '\t'}
+local LowerChars = lookupify{'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i',
+                             'j', 'k', 'l', 'm', 'n', 'o', 'p', 'q', 'r',
+                             's', 't', 'u', 'v', 'w', 'x', 'y', 'z'}
+local UpperChars = lookupify{'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I',
+                             'J', 'K', 'L', 'M', 'N', 'O', 'P', 'Q', 'R',
+                             'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z'}
+local Digits = lookupify{'0', '1', '2', '3', '4', '5', '6', '7', '8', '9'}
+local HexDigits = lookupify{'0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
+                            'A', 'a', 'B', 'b', 'C', 'c', 'D', 'd', 'E', 'e', 'F', 'f'}
+local BinDigits = lookupify{'0', '1'}
+
+local Symbols = lookupify{'+', '-', '*', '/', '^', '%', ',', '{', '}', '[', ']', '(', ')', ';', '#', '&', '|', '!'}
+
+local LuaKeywords = lookupify{
+    'and', 'break', 'do', 'else', 'elseif',
+    'end', 'false', 'for', 'function', 'goto', 'if',
+    'in', 'local', 'nil', 'not', 'or', 'repeat',
+    'return', 'then', 'true', 'until', 'while',
+};
+
+-- keywords()
+-- Return a new keyword set of the Lua keywords, for a CPU syntax to add its
+-- own.
+M.keywords = function()
+    local keywords = {}
+    for k,v in pairs(LuaKeywords) do keywords[k] = v end
+    return keywords
+end
+
+local function LexLua(src, syntax)
+    --token dump
+    local tokens = {}
+
+    local st, err = pcall(function()
+        --line / char / pointer tracking
+        local p = 1
+        local line = 1
+        local char = 1
+
+        --get / peek functions
+        local function get()
+            local c = src:sub(p,p)
+            if c == '\n' then
+                char = 1
+                line = line + 1
+            else
+                char = char + 1
+            end
+            p = p + 1
+            return c
+        end
+        local function get_n(count) for i=1,count do get() end end
+        local function peek(n)
+            n = n or 0
+            return src:sub(p+n,p+n)
+        end
+        local function peek_n(sz) return src:sub(p, p+sz-1) end
+        local function consume(chars)
+            local c = peek()
+            for i = 1, #chars do
+                if c == chars:sub(i,i) then return get() end
+            end
+        end
+        local function get_word(spaces)
+            if not spaces then spaces = Spaces end
+            local c
+            repeat get() c = peek() until not spaces[c]
+            local start = p
+            repeat get() c = peek() until not (UpperChars[c] or LowerChars[c] or Digits[c] or c == '_')
+            return src:sub(start, p-1)
+        end
+        local function peek_ident(i, spaces)
+            if not spaces then spaces = Spaces end
+            local c
+            while true do c=peek(i) if not spaces[c] then break end i=i+1 end
+            if not (UpperChars[c] or LowerChars[c] or c == '_') then return end
+            local start = p+i
+            repeat i=i+1 c = peek(i) until not (UpperChars[c] or LowerChars[c] or Digits[c] or c == '_')
+            return src:sub(start, p+i-1),i,c
+        end
+
+        --shared stuff
+        local function generateError(err)
+            return error(">> :"..line..":"..char..": "..err, 0)
+        end
+
+        local function tryGetLongString()
+            local start = p
+            if peek() == '[' then
+                local equalsCount = 0
+                local depth = 1
+                while peek(equalsCount+1) == '=' do
+                    equalsCount = equalsCount + 1
+                end
+                if peek(equalsCount+1) == '[' then
+                    --start parsing the string. Strip the starting bit
+                    for _ = 0, equalsCount+1 do get() end
+
+                    --get the contents
+                    local contentStart = p
+                    while true do
+                        --check for eof
+                        if peek() == '' then
+                            generateError("Expected ']"..string.rep('=', equalsCount).."]' near <eof>.", 3)
+                        end
+
+                        --check for the end
+                        local foundEnd = true
+                        if peek() == ']' then
+                            for i = 1, equalsCount do
+                                if peek(i) ~= '=' then foundEnd = false end
+                            end
+                            if peek(equalsCount+1) ~= ']' then
+                                foundEnd = false
+                            end
+                        else
+                            --[[
+                            if peek() == '[' then
+                                -- is there an embedded long string?
+                                local embedded = true
+                                for i = 1, equalsCount do
+                                    if peek(i) ~= '=' then
+                                        embedded = false
+                                        break
+                                    end
+                                end
+                                if peek(equalsCount + 1) == '[' and embedded then
+                                    -- oh look, there was
+                                    depth = depth + 1
+                                    for i = 1, (equalsCount + 2) do
+                                        get()
+                                    end
+                                end
+                            end
+                            ]]
+                            foundEnd = false
+                        end
+                        --
+                        if foundEnd then
+                            depth = depth - 1
+                            if depth == 0 then
+                                break
+                            else
+                                for i = 1, equalsCount + 2 do
+                                    get()
+                                end
+                            end
+                        else
+                            get()
+                        end
+                    end
+
+                    --get the interior string
+                    local contentString = src:sub(contentStart, p-1)
+
+                    --found the end. Get rid of the trailing bit
+                    for i = 0, equalsCount+1 do get() end
+
+                    --get the exterior string
+                    local longString = src:sub(start, p-1)
+
+                    --return the stuff
+                    return contentString, longString
+                else
+                    return nil
+                end
+            else
+                return nil
+            end
+        end
+
+        --main token emitting loop
+        while true do
+            --get leading whitespace. The leading whitespace will include any comments
+            --preceding the token. This prevents the parser needing to deal with comments
+            --separately.
+            local leading = { }
+            local leadingWhite = ''
+            local longStr = false
+            while true do
+                local c = peek()
+                if c == '#' and peek(1) == '!' and line == 1 then
+                    -- #! shebang for linux scripts
+                    get()
+                    get()
+                    leadingWhite = "#!"
+                    while peek() ~= '\n' and peek() ~= '' do
+                        leadingWhite = leadingWhite .. get()
+                    end
+                    local token = {
+                        Type = 'Comment',
+                        CommentType = 'Shebang',
+                        Data = leadingWhite,
+                        Line = line,
+                        Char = char
+                    }
+                    token.Print = function()
+                        return "<"..(token.Type .. string.rep(' ', 7-#token.Type)).."  "..(token.Data or '').." >"
+                    end
+                    leadingWhite = ""
+                    table.insert(leading, token)
+                end
+                if c == ' ' or c == '\t' then
+                    --whitespace
+                    --leadingWhite = leadingWhite..get()
+                    local c2 = get() -- ignore whitespace
+                    table.insert(leading, { Type = 'Whitespace', Line = line, Char = char, Data = c2 })
+                elseif c == '\n' or c == '\r' then
+                    local nl = get()
+                    if leadingWhite ~= "" then
+                        local token = {
+                            Type = 'Comment',
+                            CommentType = longStr and 'LongComment' or 'Comment',
+                            Data = leadingWhite,
+                            Line = line,
+                            Char = char,
+                        }
+                        token.Print = function()
+                            return "<"..(token.Type .. string.rep(' ', 7-#token.Type)).."  "..(token.Data or '').." >"
+                        end
+                        table.insert(leading, token)
+                        leadingWhite = ""
+                    end
+                    table.insert(leading, { Type = 'Whitespace', Line = line, Char = char, Data = nl })
+                elseif c == '-' and peek(1) == '-' then
+                    local previous = tokens[#tokens]
+                    local postfix = syntax.postfix and syntax.on() and #leading == 0 and previous
+                        and syntax.postfix(previous)
+                    if postfix then
+                        break
+                    else
+                        -- comment
+                        get()
+                        get()
+                        leadingWhite = leadingWhite .. '--'
+                        local _, wholeText = tryGetLongString()
+                        if wholeText then
+                            leadingWhite = leadingWhite..wholeText
+                            longStr = true
+                        else
+                            while peek() ~= '\n' and peek() ~= '' do
+                                leadingWhite = leadingWhite..get()
+                            end
+                        end
+                    end
+                else
+                    break
+                end
+            end
+            if leadingWhite ~= "" then
+                local token = {
+                    Type = 'Comment',
+                    CommentType = longStr and 'LongComment' or 'Comment',
+                    Data = leadingWhite,
+                    Line = line,
+                    Char = char,
+                }
+                token.Print = function()
+                    return "<"..(token.Type .. string.rep(' ', 7-#token.Type)).."  "..(token.Data or '').." >"
+                end
+                table.insert(leading, token)
+            end
+
+            --get the initial char
+            local thisLine = line
+            local thisChar = char
+            local errorAt = ":"..line..":"..char..":> "
+            local c = peek()
+
+            --symbol to emit
+            local toEmit = nil
+
+            --pragma
+            if char == 1 and peek_n(7) == '#pragma' then
+                get_n(7)
+                local dat,opt = get_word()
+                local onoff = function(f, noerr)
+                    opt = get_word()
+                    if opt == 'on' then f(true)
+                    elseif opt == 'off' then f(false)
+                    elseif not noerr then generateError("invalid option for pragma " .. dat .. ", expected: [on,off]")
+                    end
+                    return opt
+                end
+                toEmit = syntax.pragma(dat, get_word, onoff, generateError)
+                if not toEmit then generateError("unknown pragma: " .. dat) end
+
+            --branch on type
+            elseif c == '' then
+                --eof
+                toEmit = { Type = 'Eof' }
+
+            elseif UpperChars[c] or LowerChars[c] or c == '_' then
+                --ident or keyword
+                local start = p
+                repeat
+                    get()
+                    c = peek()
+                until not (UpperChars[c] or LowerChars[c] or Digits[c] or c == '_')
+                local dat = src:sub(start, p-1)
+                if syntax.keywords[dat] then
+                    toEmit = {Type = 'Keyword', Data = dat}
+                else
+                    toEmit = {Type = 'Ident', Data = dat}
+                end
+
+            elseif Digits[c] or (peek() == '.' and Digits[peek(1)]) then
+                --number const
+                local start = p
+                local data_override
+                if c == '0' and peek(1) == 'x' then
+                    get();get()
+                    while HexDigits[peek()] do get() end
+                    if consume('Pp') then
+                        consume('+-')
+                        while Digits[peek()] do get() end
+                    end
+                elseif c == '0' and peek(1) == 'b' then
+                    get();get()
+                    while BinDigits[peek()] do get() end
+                    local pstart, val_s, val = p, src:sub(start+2, p-1), 0
+                    for i=1,#val_s do
+                        if val_s:sub(i,i) == '1' then val = val + (1<<(#val_s-i)) end
+                    end
+                    if consume('Pp') then
+                        consume('+-')
+                        while Digits[peek()] do get() end
+                    end
+                    data_override = val .. src:sub(pstart, p-1)
+                else
+                    while Digits[peek()] do get() end
+                    if consume('.') then
+                        while Digits[peek()] do get() end
+                    end
+                    if consume('Ee') then
+                        consume('+-')
+                        while Digits[peek()] do get() end
+                    end
+                end
+                toEmit = {Type = 'Number', Data = data_override or src:sub(start, p-1)}
+
+            elseif c == '\'' or c == '\"' then
+                local start = p
+                --string const
+                local delim = get()
+                local contentStart = p
+                while true do
+                    local c = get()
+                    if c == '\\' then
+                        get() --get the escape char
+                    elseif c == delim then
+                        break
+                    elseif c == '' then
+                        generateError("Unfinished string near <eof>")
+                    end
+                end
+                local content = src:sub(contentStart, p-2)
+                local constant = src:sub(start, p-1)
+                toEmit = {Type = 'String', Data = constant, Constant = content}
+
+            elseif c == '[' then
+                local content, wholetext = tryGetLongString()
+                if wholetext then
+                    toEmit = {Type = 'String', Data = wholetext, Constant = content}
+                else
+                    get()
+                    toEmit = {Type = 'Symbol', Data = '['}
+                end
+
+            elseif syntax.on() and (syntax.operators[peek_n(3)] or syntax.operators[peek_n(2)]) then
+                --operator syntax of the CPU
+                local op = syntax.operators[peek_n(3)] and peek_n(3) or peek_n(2)
+                toEmit = {Type = 'Symbol', Data = op}
+                get_n(#op)
+
+            elseif c == '<' and peek(1) == c then
+                get() get()
+                toEmit = {Type = 'Symbol', Data = '<<'}
+            elseif c == '>' and peek(1) == c then
+                get() get()
+                toEmit = {Type = 'Symbol', Data = '>>'}
+
+            elseif consume('>=<') then
+                toEmit = {Type = 'Symbol', Data = consume('=') and c..'=' or c}
+
+            elseif consume('~') then
+                toEmit = {Type = 'Symbol', Data = consume('=') and '~=' or '~'}
+
+            elseif consume('.') then
+                if consume('.') then
+                    if consume('.') then
+                        toEmit = {Type = 'Symbol', Data = '...'}
+                    else
+                        toEmit = {Type = 'Symbol', Data = '..'}
+                    end
+                else
+                    toEmit = {Type = 'Symbol', Data = '.'}
+                end
+
+            elseif consume(':') then
+                toEmit = {Type = 'Symbol', Data = consume(':') and '::' or ':'}
+            elseif consume('/') then
+                toEmit = {Type = 'Symbol', Data = consume('/') and '//' or '/'}
+
+            elseif syntax.on() and consume('@') then
+                if consume('@') then
+                    toEmit = {Type = 'Symbol', Data = '@@'}
+                else
+                    toEmit = {Type = 'Symbol', Data = '@'}
+                end
+
+            elseif syntax.on() and consume('\\') then
+                toEmit = {Type = 'Symbol', Data = '\\'}
+
+            elseif Symbols[c] then
+                get()
+                toEmit = {Type = 'Symbol', Data = c}
+
+            else
+                local contents, all = tryGetLongString()
+                if contents then
+                    toEmit = {Type = 'String', Data = all, Constant = contents}
+                else
+                    generateError("Unexpected Symbol '"..c.."' in source.", 2)
+                end
+            end
+
+            if toEmit[1] then
+                toEmit[1].LeadingWhite = leading
+                for k,v in ipairs(toEmit) do
+                    v.Line = thisLine
+                    v.Char = thisChar
+                    v.Print = function()
+                        return "<"..(v.Type..string.rep(' ', 7-#v.Type)).."  "..(v.Data or '').." >"
+                    end
+                    tokens[#tokens+1] = v
+                end
+            else
+                --add the emitted symbol, after adding some common data
+                toEmit.LeadingWhite = leading -- table of leading whitespace/comments
+                --for k, tok in pairs(leading) do
+                --  tokens[#tokens + 1] = tok
+                --end
+
+                toEmit.Line = thisLine
+                toEmit.Char = thisChar
+                toEmit.Print = function()
+                    return "<"..(toEmit.Type..string.rep(' ', 7-#toEmit.Type)).."  "..(toEmit.Data or '').." >"
+                end
+                tokens[#tokens+1] = toEmit
+
+                --halt after eof has been emitted
+                if toEmit.Type == 'Eof' then break end
+            end
+        end
+    end)
+    if not st then
+        return false, err
+    end
+
+    --public interface:
+    local tok = {}
+    local savedP = {}
+    local p = 1
+    
+    function tok:getp()
+        return p
+    end
+    
+    function tok:setp(n)
+        p = n
+    end
+    
+    function tok:getTokenList()
+        return tokens
+    end
+    
+    --getters
+    function tok:Peek(n)
+        n = n or 0
+        return tokens[math.min(#tokens, p+n)]
+    end
+    function tok:Get(tokenList)
+        local t = tokens[p]
+        p = math.min(p + 1, #tokens)
+        if tokenList then
+            table.insert(tokenList, t)
+        end
+        return t
+    end
+    function tok:Is(t)
+        return tok:Peek().Type == t
+    end
+
+    --save / restore points in the stream
+    function tok:Save()
+        savedP[#savedP+1] = p
+    end
+    function tok:Commit()
+        savedP[#savedP] = nil
+    end
+    function tok:Restore()
+        p = savedP[#savedP]
+        savedP[#savedP] = nil
+    end
+
+    --either return a symbol if there is one, or return true if the requested
+    --symbol was gotten.
+    function tok:ConsumeSymbol(symb, tokenList)
+        local t = self:Peek()
+        if t.Type == 'Symbol' then
+            if symb then
+                if t.Data == symb then
+                    self:Get(tokenList)
+                    return true
+                else
+                    return nil
+                end
+            else
+                self:Get(tokenList)
+                return t
+            end
+        else
+            return nil
+        end
+    end
+
+    function tok:ConsumeKeyword(kw, tokenList)
+        local t = self:Peek()
+        if t.Type == 'Keyword' and t.Data == kw then
+            self:Get(tokenList)
+            return true
+        else
+            return nil
+        end
+    end
+
+    function tok:IsKeyword(kw)
+        local t = tok:Peek()
+        return t.Type == 'Keyword' and t.Data == kw
+    end
+
+    function tok:IsSymbol(s)
+        local t = tok:Peek()
+        return t.Type == 'Symbol' and t.Data == s
+    end
+
+    function tok:IsEof()
+        return tok:Peek().Type == 'Eof'
+    end
+
+    function tok:IsIdent()
+        local t = tok:Peek()
+        return t.Type == 'Ident' or (syntax.keyword_idents and t.Type == 'Keyword' and not LuaKeywords[t.Data])
+    end
+
+    return true, tok
+end
+
+
+local function ParseLua(src, src_name, syntax)
+    local st, tok
+    if type(src) ~= 'table' then
+        st, tok = LexLua(src, syntax)
+    else
+        st, tok = true, src
+    end
+    if not st then
+        return false, tok
+    end
+    --
+    local function GenerateError(msg)
+        local err = (src_name or '=(string)') .. ":"..tok:Peek().Line..":"..tok:Peek().Char..": "..msg.."\n "
+        --find the line
+        local lineNum = 0
+        if type(src) == 'string' then
+            for line in src:gmatch("[^\n]*\n?") do
+                if line:sub(-1,-1) == '\n' then line = line:sub(1,-2) end
+                lineNum = lineNum+1
+                if lineNum == tok:Peek().Line then
+                    err = err..line:gsub('\t','    ').."\n"
+                    for i = 1, tok:Peek().Char do
+                        local c = line:sub(i,i)
+                        if c == '\t' then
+                            err = err..'    '
+                        else
+                            err = err..' '
+                        end
+                    end
+                    err = err.."^^^^"
+                    break
+                end
+            end
+        end
+        return err
+    end
+    --
+    local VarUid = 0
+    local function CreateScope(parent)
+        local scope = Scope:new(parent)
+        scope.Print = function() return "<Scope>" end
+        return scope
+    end
+
+    local ParseExpr
+    local ParseStatementList
+    local ParseSimpleExpr,
+            ParseSubExpr,
+            ParsePrimaryExpr,
+            ParseSuffixedExpr
+
+    local function starts_new_line(token)
+        for _, white in ipairs(token.LeadingWhite or {}) do
+            if white.Data and white.Data:find("\n", 1, true) then return true end
+        end
+        return false
+    end
+
+    local function ParseFunctionArgsAndBody(scope, tokenList)
+        local funcScope = CreateScope(scope)
+        if not tok:ConsumeSymbol('(', tokenList) then
+            return false, GenerateError("'(' expected")
+        end
+
+        --arg list
+        local argList = {}
+        local isVarArg = false
+        while not tok:ConsumeSymbol(')', tokenList) do
+            if tok:IsIdent() then
+                local arg = funcScope:CreateLocal(tok:Get(tokenList).Data)
+                argList[#argList+1] = arg
+                if not tok:ConsumeSymbol(',', tokenList) then
+                    if tok:ConsumeSymbol(')', tokenList) then
+                        break
+                    else
+                        return false, GenerateError("')' expected")
+                    end
+                end
+            elseif tok:ConsumeSymbol('...', tokenList) then
+                isVarArg = true
+                if not tok:ConsumeSymbol(')', tokenList) then
+                    return false, GenerateError("'...' must be the last argument of a function")
+                end
+                break
+            else
+                return false, GenerateError("Argument name or '...' expected")
+            end
+        end
+
+        --body
+        local st, body = ParseStatementList(funcScope)
+        if not st then return false, body end
+
+        --end
+        if not tok:ConsumeKeyword('end', tokenList) then
+            return false, GenerateError("'end' expected after function body")
+        end
+        local nodeFunc = {}
+        nodeFunc.AstType   = 'Function'
+        nodeFunc.Scope     = funcScope
+        nodeFunc.Arguments = argList
+        nodeFunc.Body      = body
+        nodeFunc.VarArg    = isVarArg
+        nodeFunc.Tokens    = tokenList
+        --
+        return true, nodeFunc
+    end
+
+
+    function ParsePrimaryExpr(scope)
+        local tokenList = {}
+
+        if tok:ConsumeSymbol('(', tokenList) then
+            local st, ex = ParseExpr(scope)
+            if not st then return false, ex end
+            if not tok:ConsumeSymbol(')', tokenList) then
+                return false, GenerateError("')' expected")
+            end
+            if false then
+                --save the information about parenthesized expressions somewhere
+                ex.ParenCount = (ex.ParenCount or 0) + 1
+                return true, ex
+            else
+                local parensExp = {}
+                parensExp.AstType   = 'Parentheses'
+                parensExp.Inner     = ex
+                parensExp.Tokens    = tokenList
+                return true, parensExp
+            end
+
+        elseif tok:IsIdent() then
+            local id = tok:Get(tokenList)
+            local var = scope:GetLocal(id.Data)
+            if not var then
+                var = scope:GetGlobal(id.Data)
+                if not var then
+                    var = scope:CreateGlobal(id.Data)
+                end
+            end
+            --
+            local nodePrimExp = {}
+            nodePrimExp.AstType   = 'VarExpr'
+            nodePrimExp.Name      = id.Data
+            nodePrimExp.Variable  = var
+            nodePrimExp.Tokens    = tokenList
+            --
+            return true, nodePrimExp
+
+        else
+            return false, GenerateError("Primary expression expected")
+        end
+    end
+
+    function ParseSuffixedExpr(scope, onlyDotColon)
+        --base primary expression
+        local st, prim = ParsePrimaryExpr(scope)
+        if not st then return false, prim end
+        --
+        while true do
+            local tokenList = {}
+
+            if tok:IsSymbol('.') or tok:IsSymbol(':') then
+                local symb = tok:Get(tokenList).Data
+                if not tok:IsIdent() then
+                    return false, GenerateError("Identifier expected")
+                end
+                local id = tok:Get(tokenList)
+                local nodeIndex = {}
+                nodeIndex.AstType  = 'MemberExpr'
+                nodeIndex.Base     = prim
+                nodeIndex.Indexer  = symb
+                nodeIndex.Ident    = id
+                nodeIndex.Tokens   = tokenList
+                --
+                prim = nodeIndex
+
+            -- With the operator syntax of the CPU, a bracket beginning a new
+            -- line is a memory destination, not a Lua index suffix on the
+            -- previous line.
+            elseif not onlyDotColon and tok:IsSymbol('[')
+               and not (syntax.bracket_operands and starts_new_line(tok:Peek())) then
+                tok:Get(tokenList)
+                local st, ex = ParseExpr(scope)
+                if not st then return false, ex end
+                if not tok:ConsumeSymbol(']', tokenList) then
+                    return false, GenerateError("']' expected")
+                end
+                local nodeIndex = {}
+                nodeIndex.AstType  = 'IndexExpr'
+                nodeIndex.Base     = prim
+                nodeIndex.Index    = ex
+                nodeIndex.Tokens   = tokenList
+                --
+                prim = nodeIndex
+
+            elseif not onlyDotColon and tok:ConsumeSymbol('(', tokenList) then
+                local args = {}
+                while not tok:ConsumeSymbol(')', tokenList) do
+                    local st, ex = ParseExpr(scope)
+                    if not st then return false, ex end
+                    args[#args+1] = ex
+                    if not tok:ConsumeSymbol(',', tokenList) then
+                        if tok:ConsumeSymbol(')', tokenList) then
+                            break
+                        else
+                            return false, GenerateError("')' expected")
+                        end
+                    end
+                end
+                local nodeCall = {}
+                nodeCall.AstType   = 'CallExpr'
+                nodeCall.Base      = prim
+                nodeCall.Arguments = args
+                nodeCall.Tokens    = tokenList
+                --
+                prim = nodeCall
+
+            elseif not onlyDotColon and tok:Is('String') then
+                --string call
+                local nodeCall = {}
+                nodeCall.AstType    = 'StringCallExpr'
+                nodeCall.Base       = prim
+                nodeCall.Arguments  = { tok:Get(tokenList) }
+                nodeCall.Tokens     = tokenList
+                --
+                prim = nodeCall
+
+            elseif not onlyDotColon and tok:IsSymbol('{') then
+                --table call
+                local st, ex = ParseSimpleExpr(scope)
+                -- FIX: ParseExpr(scope) parses the table AND and any following binary expressions.
+                -- We just want the table
+                if not st then return false, ex end
+                local nodeCall = {}
+                nodeCall.AstType   = 'TableCallExpr'
+                nodeCall.Base      = prim
+                nodeCall.Arguments = { ex }
+                nodeCall.Tokens    = tokenList
+                --
+                prim = nodeCall
+
+            else
+                break
+            end
+        end
+        return true, prim
+    end
+
+
+    function ParseSimpleExpr(scope)
+        local tokenList = {}
+
+        if tok:Is('Number') then
+            local nodeNum = {}
+            nodeNum.AstType = 'NumberExpr'
+            nodeNum.Value   = tok:Get(tokenList)
+            nodeNum.Tokens  = tokenList
+            return true, nodeNum
+
+        elseif tok:Is('String') then
+            local nodeStr = {}
+            nodeStr.AstType = 'StringExpr'
+            nodeStr.Value   = tok:Get(tokenList)
+            nodeStr.Tokens  = tokenList
+            return true, nodeStr
+
+        elseif tok:ConsumeKeyword('nil', tokenList) then
+            local nodeNil = {}
+            nodeNil.AstType = 'NilExpr'
+            nodeNil.Tokens  = tokenList
+            return true, nodeNil
+
+        elseif tok:IsKeyword('false') or tok:IsKeyword('true') then
+            local nodeBoolean = {}
+            nodeBoolean.AstType = 'BooleanExpr'
+            nodeBoolean.Value   = (tok:Get(tokenList).Data == 'true')
+            nodeBoolean.Tokens  = tokenList
+            return true, nodeBoolean
+
+        elseif tok:ConsumeSymbol('...', tokenList) then
+            local nodeDots = {}
+            nodeDots.AstType  = 'DotsExpr'
+            nodeDots.Tokens   = tokenList
+            return true, nodeDots
+
+        elseif tok:ConsumeSymbol('{', tokenList) then
+            local v = {}
+            v.AstType = 'ConstructorExpr'
+            v.EntryList = {}
+            --
+            while true do
+                if tok:IsSymbol('[', tokenList) then
+                    --key
+                    tok:Get(tokenList)
+                    local st, key = ParseExpr(scope)
+                    if not st then
+                        return false, GenerateError("Key expression expected")
+                    end
+                    if not tok:ConsumeSymbol(']', tokenList) then
+                        return false, GenerateError("']' expected")
+                    end
+                    if not tok:ConsumeSymbol('=', tokenList) then
+                        return false, GenerateError("'=' expected")
+                    end
+                    local st, value = ParseExpr(scope)
+                    if not st then
+                        return false, GenerateError("Value expression expected")
+                    end
+                    v.EntryList[#v.EntryList+1] = {
+                        Type  = 'Key';
+                        Key   = key;
+                        Value = value;
+                    }
+
+                elseif tok:IsIdent() then
+                    --value or key
+                    local lookahead = tok:Peek(1)
+                    if lookahead.Type == 'Symbol' and lookahead.Data == '=' then
+                        --we are a key
+                        local key = tok:Get(tokenList)
+                        if not tok:ConsumeSymbol('=', tokenList) then
+                            return false, GenerateError("'=' expected")
+                        end
+                        local st, value = ParseExpr(scope)
+                        if not st then
+                            return false, GenerateError("Value expression expected")
+                        end
+                        v.EntryList[#v.EntryList+1] = {
+                            Type  = 'KeyString';
+                            Key   = key.Data;
+                            Value = value;
+                        }
+
+                    else
+                        --we are a value
+                        local st, value = ParseExpr(scope)
+                        if not st then
+                            return false, GenerateError("Value expected")
+                        end
+                        v.EntryList[#v.EntryList+1] = {
+                            Type = 'Value';
+                            Value = value;
+                        }
+
+                    end
+                elseif tok:ConsumeSymbol('}', tokenList) then
+                    break
+
+                else
+                    --value
+                    local st, value = ParseExpr(scope)
+                    v.EntryList[#v.EntryList+1] = {
+                        Type = 'Value';
+                        Value = value;
+                    }
+                    if not st then
+                        return false, GenerateError("Value expected")
+                    end
+                end
+
+                if tok:ConsumeSymbol(';', tokenList) or tok:ConsumeSymbol(',', tokenList) then
+                    --all is good
+                elseif tok:ConsumeSymbol('}', tokenList) then
+                    break
+                else
+                    return false, GenerateError("'}' or table entry expected")
+                end
+            end
+            v.Tokens  = tokenList
+            return true, v
+
+        elseif tok:ConsumeKeyword('function', tokenList) then
+            local st, func = ParseFunctionArgsAndBody(scope, tokenList)
+            if not st then return false, func end
+            --
+            func.IsLocal = true
+            return true, func
+
+        elseif tok:ConsumeSymbol('\\', tokenList) then -- short lambdas \params(expr)
+            local funcScope = CreateScope(scope)
+
+            local argList = {}
+            if not tok:ConsumeSymbol('(', tokenList) then while true do
+                if not tok:IsIdent() then return false, GenerateError("Identifier expected") end
+                argList[#argList+1] = funcScope:CreateLocal(tok:Get(tokenList).Data)
+                if tok:ConsumeSymbol('(', tokenList) then break end
+                if not tok:ConsumeSymbol(',', tokenList) then return false, GenerateError("'(' expected") end
+            end end
+            local st, body = ParseExpr(funcScope)
+            if not st then return false, body end
+            if not tok:ConsumeSymbol(')', tokenList) then return false, GenerateError("')' expected after lambda body") end
+
+            local last_tok = body.Tokens[1]
+            local last_char,last_line = last_tok.Char,last_tok.Line
+            local space = { Char=last_char, Line=last_line, Data=' ', Type='Whitespace' }
+            local ret = { AstType='ReturnStatement', Arguments={body}, TrailingWhite=true, Tokens={
+                { Char=last_char, Line=last_line, Print=function() return '<Keyword  return >' end, LeadingWhite={space}, Type='Keyword', Data='return' }
+            }}
+            local statList = { AstType='Statlist', Scope=CreateScope(funcScope), Tokens={}, Body={ret} }
+            
+            local tok_first = tokenList[1]
+            tok_first.Type = 'Keyword'
+            tok_first.Data = 'function'
+            tok_first.Print=function() return '<Keyword  function >' end
+
+            local ntokl = {}
+            local paren_ix = 2 + math.max(0, #argList*2-1)
+            table.insert(ntokl, tokenList[1])
+            table.insert(ntokl, tokenList[paren_ix])
+            for i=2,paren_ix-1 do table.insert(ntokl, tokenList[i]) end
+            table.insert(ntokl, tokenList[#tokenList])
+            table.insert(ntokl, { Char=last_char, Line=last_line, Type='Keyword', Data='end', Print=function() return '<Keyword  end >' end, LeadingWhite={space} })
+
+            local func = { AstType='Function', Scope=funcScope, Arguments=argList, Body=statList, VarArg=false, Tokens=ntokl, isLocal=true }
+            return true, func
+
+        else
+            return ParseSuffixedExpr(scope)
+        end
+    end
+
+
+    local unops = lookupify{'-', 'not', '#', '~'}
+    local unopprio = 12
+    local priority = {
+        ['^'] = {14,13};
+        ['%'] = {11,11};
+        ['//'] = {11,11};
+        ['/'] = {11,11};
+        ['*'] = {11,11};
+        ['+'] = {10,10};
+        ['-'] = {10,10};
+        ['..'] = {9,8};
+        ['>>'] = {7,7};
+        ['<<'] = {7,7};
+        ['&'] = {6,6};
+        ['~'] = {5,5};
+        ['|'] =  {4,4};
+        ['=='] = {3,3};
+        ['<'] = {3,3};
+        ['<='] = {3,3};
+        ['~='] = {3,3};
+        ['>'] = {3,3};
+        ['>='] = {3,3};
+        ['and'] = {2,2};
+        ['or'] = {1,1};
+    }
+    function ParseSubExpr(scope, level)
+        --base item, possibly with unop prefix
+        local st, exp
+        if unops[tok:Peek().Data] then
+            local tokenList = {}
+            local op = tok:Get(tokenList).Data
+            st, exp = ParseSubExpr(scope, unopprio)
+            if not st then return false, exp end
+            local nodeEx = {}
+            nodeEx.AstType = 'UnopExpr'
+            nodeEx.Rhs     = exp
+            nodeEx.Op      = op
+            nodeEx.OperatorPrecedence = unopprio
+            nodeEx.Tokens  = tokenList
+            exp = nodeEx
+        else
+            st, exp = ParseSimpleExpr(scope)
+            if not st then return false, exp end
+        end
+
+        --next items in chain
+        while true do
+            local prio = priority[tok:Peek().Data]
+            if prio and prio[1] > level then
+                local tokenList = {}
+                local op = tok:Get(tokenList).Data
+                local st, rhs = ParseSubExpr(scope, prio[2])
+                if not st then return false, rhs end
+                local nodeEx = {}
+                nodeEx.AstType = 'BinopExpr'
+                nodeEx.Lhs     = exp
+                nodeEx.Op      = op
+                nodeEx.OperatorPrecedence = prio[1]
+                nodeEx.Rhs     = rhs
+                nodeEx.Tokens  = tokenList
+                --
+                exp = nodeEx
+            else
+                break
+            end
+        end
+
+        return true, exp
+    end
+
+
+    ParseExpr = function(scope)
+        return ParseSubExpr(scope, 0)
+    end
+
+
+    local function ParseStatement(scope)
+        local stat = nil
+        local tokenList = {}
+        local commaTokenList = {}
+        local l,c = function() return tokenList[1].Line end, function() return tokenList[1].Char end
+        local p = function(t,n) return function() return '<' .. t .. string.rep(' ', 7-#t) .. ' ' .. n .. ' >' end end
+        local t = function(t,s,w) return { Type=t, Data=s, Print=p(t,s), Char=c(), Line=l(), LeadingWhite=w or {} } end
+        local no_encapsulation = { Function=true, NumberExpr=true, StringExpr=true }
+        local function emit_call(params)
+            local name,args,inverse_encapsulate = params.name, params.args or {}, params.inverse_encapsulate
+            if not params.func_white then params.func_white = tokenList[1].LeadingWhite end
+            local space = { Char=c(), Line=l(), Data=' ', Type='Whitespace' }
+            local op_var = {
+                AstType='VarExpr', Name=name, Variable={ IsGlobal=true, Name=name, Scope=CreateScope(scope) }, Tokens = { t('Ident', name, params.func_white) }
+            }
+            local encapsulate = params.encapsulate
+            if encapsulate == nil then encapsulate = syntax.encapsulate() end
+            if type(inverse_encapsulate) == 'table' then
+                -- this is a list of arguments, where each can be encapsulated
+                for arg_ix,arg in ipairs(args) do
+                    if ( (encapsulate and not inverse_encapsulate[arg_ix]) or (not encapsulate and inverse_encapsulate[arg_ix]) ) and not no_encapsulation[arg.AstType] and not arg.NoEncapsulation then
+                        local inner_call_scope = CreateScope(op_var.Variable.Scope)
+                        local inner_call_body = {
+                            AstType='StatList', Scope=CreateScope(inner_call_scope), Tokens={}, Body={
+                                { AstType='ReturnStatement', Arguments={arg}, Tokens={ t('Keyword', 'return', {space}) } }
+                            }
+                        }
+                        local inner_call = {
+                            AstType='Function', VarArg=false, IsLocal=true, Scope=inner_call_scope, Body=inner_call_body, Arguments={},
+                            Tokens={ t('Keyword', 'function'), t('Symbol', '('), t('Symbol', ')'), t('Keyword', 'end', {space}) }
+                        }
+                        if #arg.Tokens[1].LeadingWhite == 0 then table.insert(arg.Tokens[1].LeadingWhite, space) end
+                        args[arg_ix] = inner_call
+                    end
+                end
+            elseif #args > 0 and ( (encapsulate and not inverse_encapsulate) or (not encapsulate and inverse_encapsulate) ) and not no_encapsulation[args[1].AstType] and not args[1].NoEncapsulation then
+                -- opcode arguments of type (late, early), where only late is to be encapsulated with _o parameter to be set to early and added to _f(late)
+                -- unless it is integer arithmetic over numbers and global names, passed as expression nodes
+                local operand = not params.basic and syntax.operand_expr and M.operand_expr(args[1])
+                local inner_call_scope,inner_call = CreateScope(op_var.Variable.Scope)
+                if operand then
+                    inner_call = operand
+                elseif params.basic then
+                    local inner_call_body = {
+                        AstType='StatList', Scope=CreateScope(inner_call_scope), Tokens={}, Body={
+                            { AstType='ReturnStatement', Arguments={args[1]}, Tokens={ t('Keyword', 'return', {space}) } }
+                        }
+                    }
+                    inner_call = {
+                        AstType='Function', VarArg=false, IsLocal=true, Scope=inner_call_scope, Body=inner_call_body, Arguments={},
+                        Tokens={ t('Keyword', 'function'), t('Symbol', '('), t('Symbol', ')'), t('Keyword', 'end', {space}) }
+                    }
+                else
+                    local fvarexpr = {
+                        AstType='VarExpr', Name='_f', Variable={ Name='_f', Scope=CreateScope(inner_call_scope) }, Tokens = { t('Ident', '_f') }
+                    }
+                    local inner_add = {
+                        AstType='BinopExpr', Op='+', OperatorPrecedence=10, Tokens={ t('Symbol', '+') },
+                        Lhs = {
+                            AstType='VarExpr', Name='_o', Variable={ IsGlobal=false, Name='_o', Scope=inner_call_scope }, Tokens={ t('Ident', '_o', {space}) }
+                        },
+                        Rhs = {
+                            AstType = 'CallExpr', Base = fvarexpr, Arguments = {args[1]}, Tokens = { t('Symbol', '('), t('Symbol', ')') }
+                        }
+                    }
+                    local inner_call_body = {
+                        AstType='StatList', Scope=CreateScope(inner_call_scope), Tokens={}, Body={
+                            { AstType='ReturnStatement', Arguments={inner_add}, Tokens={ t('Keyword', 'return', {space}) } }
+                        }
+                    }
+                    inner_call = {
+                        AstType='Function', VarArg=false, IsLocal=true, Scope=inner_call_scope, Body=inner_call_body,
+                        Arguments={
+                            { IsGlobal=false, Name='_o', Scope=inner_call_scope },
+                            { IsGlobal=false, Name='_f', Scope=inner_call_scope },
+                        },
+                        Tokens={ t('Keyword', 'function'), t('Symbol', '('), t('Ident', '_o'), t('Symbol', ','), t('Ident', '_f'), t('Symbol', ')'), t('Keyword', 'end', {space}) }
+                    }
+                end
+                args[1] = inner_call
+            end
+            local exp_call = {
+                AstType = 'CallExpr', Base = op_var, Arguments = args, Tokens = {
+                    t('Symbol', '(', params.paren_open_white), t('Symbol', ')', params.paren_close_white)
+                }
+            }
+            do
+                local j=#commaTokenList
+                for i=2,#args do
+                    assert(j > 0)
+                    table.insert(exp_call.Tokens, i, commaTokenList[j])
+                    j = j - 1
+                end
+            end
+            return { AstType = 'CallStatement', Expression = exp_call, Tokens = {} }
+        end
+
+        local function as_string_expr(expr, s)
+            local ss = '"'..s..'"'
+            local lw = expr.Tokens and #expr.Tokens > 0 and expr.Tokens[1].LeadingWhite or {}
+            local p = function() return '<String   '..s..' >' end
+            local v = { LeadingWhite=lw, Type='String', Data=ss, Constant=s, Char=c(), Line=l(), Print=p }
+            return { AstType = 'StringExpr', Value = v, Tokens = {v} }
+        end
+
+        -- parser pragmas
+        do
+            ::search_pragma::
+            for k,v in pairs(syntax.pragmas) do
+                if tok:ConsumeKeyword(k) then v() goto search_pragma end
+            end
+        end
+
+        -- label declarations
+        if not stat then
+        if tok:ConsumeSymbol('@@', tokenList) then
+            if not tok:IsIdent() then return false, GenerateError("Identifier expected") end
+            local label_name = tok:Get(tokenList)
+            label_name = as_string_expr(label_name, label_name.Data)
+            stat = emit_call{name = 'section', args = {label_name}, encapsulate=false}
+        elseif tok:ConsumeSymbol('@', tokenList) then
+            if not tok:IsIdent() then return false, GenerateError("Identifier expected") end
+            local label_name = tok:Get(tokenList)
+            label_name = as_string_expr(label_name, label_name.Data)
+            stat = emit_call{name = 'label', args = {label_name}, encapsulate=false}
+        end end
+
+        -- new statements
+        if not stat then
+            local pagestat = function(fpage, args)
+                local st, nodeBlock = ParseStatementList(scope)
+                if not st then return false, nodeBlock end
+                if not tok:ConsumeKeyword('end', tokenList) then
+                    return false, GenerateError("'end' expected")
+                end
+
+                local nodeDoStat = {}
+                nodeDoStat.AstType = 'DoStatement'
+                nodeDoStat.Body    = nodeBlock
+                nodeDoStat.Tokens  = tokenList
+                stat = nodeDoStat
+
+                tokenList[1].Data = 'do'
+
+                local space = {{ Char=c(), Line=l(), Data=' ', Type='Whitespace' }}
+                local opencall,closecall = emit_call{name=fpage,args=args,encapsulate=false,func_white=space},emit_call{name='endpage',func_white=space}
+                table.insert(nodeBlock.Body, 1, opencall)
+                table.insert(nodeBlock.Body, closecall)
+            end
+            local cyclestat = function(fcycles)
+                -- the arguments are passed to the opening call, out of the block tokens
+                local argTokens = {}
+                if not tok:ConsumeSymbol('(', argTokens) then return false, GenerateError("'(' expected") end
+                local args = {}
+                repeat
+                    local st, expr = ParseExpr(scope)
+                    if not st then return false, expr end
+                    args[#args+1] = expr
+                    if not tok:ConsumeSymbol(',', argTokens) then break end
+                    commaTokenList[#commaTokenList+1] = argTokens[#argTokens]
+                until false
+                if not tok:ConsumeSymbol(')', argTokens) then return false, GenerateError("')' expected") end
+                return pagestat(fcycles, args)
+            end
+            if tok:ConsumeKeyword('samepage', tokenList) then pagestat('samepage')
+            elseif tok:ConsumeKeyword('crosspage', tokenList) then pagestat('crosspage')
+            elseif tok:ConsumeKeyword('cycles_exact', tokenList) then local st, err = cyclestat('cycles_exact') if st == false then return st, err end
+            elseif tok:ConsumeKeyword('cycles_max', tokenList) then local st, err = cyclestat('cycles_max') if st == false then return st, err end
+            end
+        end
+
+        -- declare data
+        if not stat then
+        if tok:ConsumeKeyword('dc', tokenList) then
+            if not tok:ConsumeSymbol('.', tokenList) then return false, GenerateError("'.' expected") end
+            local suffix_list = { b='byte', w='word', l='long' }
+            local func = suffix_list[tok:Get(tokenList).Data]
+            if not func then return false, GenerateError("'b', 'w' or 'l' expected") end
+            local inverse_encapsulate={}
+            inverse_encapsulate[1] = tok:ConsumeSymbol('!', tokenList)
+            local st, expr = ParseExpr(scope)
+            if not st then return false, expr end
+            if inverse_encapsulate[1] then
+                local d = expr.Tokens[1].LeadingWhite
+                for _,v in ipairs(tokenList[#tokenList].LeadingWhite) do table.insert(d, v) end
+            end
+            local exprs = { expr }
+            while tok:ConsumeSymbol(',', tokenList) do
+                commaTokenList[#commaTokenList+1] = tokenList[#tokenList]
+                inverse_encapsulate[#exprs+1] = tok:ConsumeSymbol('!', tokenList)
+                local st, expr = ParseExpr(scope)
+                if not st then return false, expr end
+                if inverse_encapsulate[#exprs+1] then
+                    local d = expr.Tokens[1].LeadingWhite
+                    for _,v in ipairs(tokenList[#tokenList].LeadingWhite) do table.insert(d, v) end
+                end
+                exprs[#exprs+1] = expr
+            end
+            stat = emit_call{name=func, args=exprs, inverse_encapsulate=inverse_encapsulate}
+        end end
+
+        -- CPU statements: opcodes, and its operator syntax if any
+        if not stat then
+            local st, cpu_stat = syntax.statement{
+                tok=tok, scope=scope, tokenList=tokenList, commaTokenList=commaTokenList,
+                ParseExpr=ParseExpr, GenerateError=GenerateError, CreateScope=CreateScope,
+                starts_new_line=starts_new_line, emit_call=emit_call, as_string_expr=as_string_expr,
+                t=t, c=c, l=l,
+            }
+            if not st then return false, cpu_stat end
+            stat = cpu_stat
+        end
+
+        if stat then -- nothing
+        elseif tok:ConsumeKeyword('if', tokenList) then
+            --setup
+            local nodeIfStat = {}
+            nodeIfStat.AstType = 'IfStatement'
+            nodeIfStat.Clauses = {}
+
+            --clauses
+            repeat
+                local st, nodeCond = ParseExpr(scope)
+                if not st then return false, nodeCond end
+                if not tok:ConsumeKeyword('then', tokenList) then
+                    return false, GenerateError("'then' expected")
+                end
+                local st, nodeBody = ParseStatementList(scope)
+                if not st then return false, nodeBody end
+                nodeIfStat.Clauses[#nodeIfStat.Clauses+1] = {
+                    Condition = nodeCond;
+                    Body = nodeBody;
+                }
+            until not tok:ConsumeKeyword('elseif', tokenList)
+
+            --else clause
+            if tok:ConsumeKeyword('else', tokenList) then
+                local st, nodeBody = ParseStatementList(scope)
+                if not st then return false, nodeBody end
+                nodeIfStat.Clauses[#nodeIfStat.Clauses+1] = {
+                    Body = nodeBody;
+                }
+            end
+
+            --end
+            if not tok:ConsumeKeyword('end', tokenList) then
+                return false, GenerateError("'end' expected")
+            end
+
+            nodeIfStat.Tokens = tokenList
+            stat = nodeIfStat
+
+        elseif tok:ConsumeKeyword('while', tokenList) then
+            --setup
+            local nodeWhileStat = {}
+            nodeWhileStat.AstType = 'WhileStatement'
+
+            --condition
+            local st, nodeCond = ParseExpr(scope)
+            if not st then return false, nodeCond end
+
+            --do
+            if not tok:ConsumeKeyword('do', tokenList) then
+                return false, GenerateError("'do' expected")
+            end
+
+            --body
+            local st, nodeBody = ParseStatementList(scope)
+            if not st then return false, nodeBody end
+
+            --end
+            if not tok:ConsumeKeyword('end', tokenList) then
+                return false, GenerateError("'end' expected")
+            end
+
+            --return
+            nodeWhileStat.Condition = nodeCond
+            nodeWhileStat.Body      = nodeBody
+            nodeWhileStat.Tokens    = tokenList
+            stat = nodeWhileStat
+
+        elseif tok:ConsumeKeyword('do', tokenList) then
+            --do block
+            local st, nodeBlock = ParseStatementList(scope)
+            if not st then return false, nodeBlock end
+            if not tok:ConsumeKeyword('end', tokenList) then
+                return false, GenerateError("'end' expected")
+            end
+
+            local nodeDoStat = {}
+            nodeDoStat.AstType = 'DoStatement'
+            nodeDoStat.Body    = nodeBlock
+            nodeDoStat.Tokens  = tokenList
+            stat = nodeDoStat
+
+        elseif tok:ConsumeKeyword('for', tokenList) then
+            --for block
+            if not tok:IsIdent() then
+                return false, GenerateError("Identifier expected")
+            end
+            local baseVarName = tok:Get(tokenList)
+            if tok:ConsumeSymbol('=', tokenList) then
+                --numeric for
+                local forScope = CreateScope(scope)
+                local forVar = forScope:CreateLocal(baseVarName.Data)
+                --
+                local st, startEx = ParseExpr(scope)
+                if not st then return false, startEx end
+                if not tok:ConsumeSymbol(',', tokenList) then
+                    return false, GenerateError("',' expected")
+                end
+                local st, endEx = ParseExpr(scope)
+                if not st then return false, endEx end
+                local st, stepEx;
+                if tok:ConsumeSymbol(',', tokenList) then
+                    st, stepEx = ParseExpr(scope)
+                    if not st then return false, stepEx end
+                end
+                if not tok:ConsumeKeyword('do', tokenList) then
+                    return false, GenerateError("'do' expected")
+                end
+                --
+                local st, body = ParseStatementList(forScope)
+                if not st then return false, body end
+                if not tok:ConsumeKeyword('end', tokenList) then
+                    return false, GenerateError("'end' expected")
+                end
+                --
+                local nodeFor = {}
+                nodeFor.AstType  = 'NumericForStatement'
+                nodeFor.Scope    = forScope
+                nodeFor.Variable = forVar
+                nodeFor.Start    = startEx
+                nodeFor.End      = endEx
+                nodeFor.Step     = stepEx
+                nodeFor.Body     = body
+                nodeFor.Tokens   = tokenList
+                stat = nodeFor
+            else
+                --generic for
+                local forScope = CreateScope(scope)
+                --
+                local varList = { forScope:CreateLocal(baseVarName.Data) }
+                while tok:ConsumeSymbol(',', tokenList) do
+                    if not tok:IsIdent() then
+                        return false, GenerateError("for variable expected.")
+                    end
+                    varList[#varList+1] = forScope:CreateLocal(tok:Get(tokenList).Data)
+                end
+                if not tok:ConsumeKeyword('in', tokenList) then
+                    return false, GenerateError("'in' expected")
+                end
+                local generators = {}
+                local st, firstGenerator = ParseExpr(scope)
+                if not st then return false, firstGenerator end
+                generators[#generators+1] = firstGenerator
+                while tok:ConsumeSymbol(',', tokenList) do
+                    local st, gen = ParseExpr(scope)
+                    if not st then return false, gen end
+                    generators[#generators+1] = gen
+                end
+                if not tok:ConsumeKeyword('do', tokenList) then
+                    return false, GenerateError("'do' expected")
+                end
+                local st, body = ParseStatementList(forScope)
+                if not st then return false, body end
+                if not tok:ConsumeKeyword('end', tokenList) then
+                    return false, GenerateError("'end' expected")
+                end
+                --
+                local nodeFor = {}
+                nodeFor.AstType      = 'GenericForStatement'
+                nodeFor.Scope        = forScope
+                nodeFor.VariableList = varList
+                nodeFor.Generators   = generators
+                nodeFor.Body         = body
+                nodeFor.Tokens       = tokenList
+                stat = nodeFor
+            end
+
+        elseif tok:ConsumeKeyword('repeat', tokenList) then
+            local st, body = ParseStatementList(scope)
+            if not st then return false, body end
+            --
+            if not tok:ConsumeKeyword('until', tokenList) then
+                return false, GenerateError("'until' expected")
+            end
+            -- FIX: Used to parse in parent scope
+            -- Now parses in repeat scope
+            local st, cond = ParseExpr(body.Scope)
+            if not st then return false, cond end
+            --
+            local nodeRepeat = {}
+            nodeRepeat.AstType   = 'RepeatStatement'
+            nodeRepeat.Condition = cond
+            nodeRepeat.Body      = body
+            nodeRepeat.Tokens    = tokenList
+            stat = nodeRepeat
+
+        elseif tok:ConsumeKeyword('function', tokenList) then
+            if not tok:IsIdent() then
+                return false, GenerateError("function name expected")
+            end
+            local st, name = ParseSuffixedExpr(scope, true) --true => only dots and colons
+            if not st then return false, name end
+            --
+            local st, func = ParseFunctionArgsAndBody(scope, tokenList)
+            if not st then return false, func end
+            --
+            func.IsLocal = false
+            func.Name    = name
+            stat = func
+
+        elseif tok:ConsumeKeyword('local', tokenList) then
+            if tok:IsIdent() then
+                local varList = { tok:Get(tokenList).Data }
+                while tok:ConsumeSymbol(',', tokenList) do
+                    if not tok:IsIdent() then
+                        return false, GenerateError("local var name expected")
+                    end
+                    varList[#varList+1] = tok:Get(tokenList).Data
+                end
+
+                local initList = {}
+                if tok:ConsumeSymbol('=', tokenList) then
+                    repeat
+                        local st, ex = ParseExpr(scope)
+                        if not st then return false, ex end
+                        initList[#initList+1] = ex
+                    until not tok:ConsumeSymbol(',', tokenList)
+                end
+
+                --now patch var list
+                --we can't do this before getting the init list, because the init list does not
+                --have the locals themselves in scope.
+                for i, v in pairs(varList) do
+                    varList[i] = scope:CreateLocal(v)
+                end
+
+                local nodeLocal = {}
+                nodeLocal.AstType   = 'LocalStatement'
+                nodeLocal.LocalList = varList
+                nodeLocal.InitList  = initList
+                nodeLocal.Tokens    = tokenList
+                --
+                stat = nodeLocal
+
+            elseif tok:ConsumeKeyword('function', tokenList) then
+                if not tok:IsIdent() then
+                    return false, GenerateError("function name expected")
+                end
+                local name = tok:Get(tokenList).Data
+                local localVar = scope:CreateLocal(name)
+                --
+                local st, func = ParseFunctionArgsAndBody(scope, tokenList)
+                if not st then return false, func end
+                --
+                func.Name         = localVar
+                func.IsLocal      = true
+                stat = func
+
+            else
+                return false, GenerateError("local var or function def expected")
+            end
+
+        elseif tok:ConsumeSymbol('::', tokenList) then
+            if not tok:IsIdent() then
+                return false, GenerateError('Label name expected')
+            end
+            local label = tok:Get(tokenList).Data
+            if not tok:ConsumeSymbol('::', tokenList) then
+                return false, GenerateError("'::' expected")
+            end
+            local nodeLabel = {}
+            nodeLabel.AstType = 'LabelStatement'
+            nodeLabel.Label   = label
+            nodeLabel.Tokens  = tokenList
+            stat = nodeLabel
+
+        elseif tok:ConsumeKeyword('return', tokenList) then
+            local exList = {}
+            if not tok:IsKeyword('end') then
+                local st, firstEx = ParseExpr(scope)
+                if st then
+                    exList[1] = firstEx
+                    while tok:ConsumeSymbol(',', tokenList) do
+                        local st, ex = ParseExpr(scope)
+                        if not st then return false, ex end
+                        exList[#exList+1] = ex
+                    end
+                end
+            end
+
+            local nodeReturn = {}
+            nodeReturn.AstType   = 'ReturnStatement'
+            nodeReturn.Arguments = exList
+            nodeReturn.Tokens    = tokenList
+            stat = nodeReturn
+
+        elseif tok:ConsumeKeyword('break', tokenList) then
+            local nodeBreak = {}
+            nodeBreak.AstType = 'BreakStatement'
+            nodeBreak.Tokens  = tokenList
+            stat = nodeBreak
+
+        elseif tok:ConsumeKeyword('goto', tokenList) then
+            if not tok:IsIdent() then
+                return false, GenerateError("Label expected")
+            end
+            local label = tok:Get(tokenList).Data
+            local nodeGoto = {}
+            nodeGoto.AstType = 'GotoStatement'
+            nodeGoto.Label   = label
+            nodeGoto.Tokens  = tokenList
+            stat = nodeGoto
+
+        elseif tok:IsSymbol(';') then
+            stat = { AstType='SemicolonStatement', Tokens={} }
+
+        else
+
+            --statementParseExpr
+            local st, suffixed = ParseSuffixedExpr(scope)
+            if not st then return false, suffixed end
+
+            --assignment or call?
+            if tok:IsSymbol(',') or tok:IsSymbol('=') then
+                --check that it was not parenthesized, making it not an lvalue
+                if (suffixed.ParenCount or 0) > 0 then
+                    return false, GenerateError("Can not assign to parenthesized expression, is not an lvalue")
+                end
+
+                --more processing needed
+                local lhs = { suffixed }
+                while tok:ConsumeSymbol(',', tokenList) do
+                    local st, lhsPart = ParseSuffixedExpr(scope)
+                    if not st then return false, lhsPart end
+                    lhs[#lhs+1] = lhsPart
+                end
+
+                --equals
+                if not tok:ConsumeSymbol('=', tokenList) then
+                    return false, GenerateError("'=' expected")
+                end
+
+                --rhs
+                local rhs = {}
+                local st, firstRhs = ParseExpr(scope)
+                if not st then return false, firstRhs end
+                rhs[1] = firstRhs
+                while tok:ConsumeSymbol(',', tokenList) do
+                    local st, rhsPart = ParseExpr(scope)
+                    if not st then return false, rhsPart end
+                    rhs[#rhs+1] = rhsPart
+                end
+
+                --done
+                local nodeAssign = {}
+                nodeAssign.AstType = 'AssignmentStatement'
+                nodeAssign.Lhs     = lhs
+                nodeAssign.Rhs     = rhs
+                nodeAssign.Tokens  = tokenList
+                stat = nodeAssign
+
+            elseif suffixed.AstType == 'CallExpr' or
+                   suffixed.AstType == 'TableCallExpr' or
+                   suffixed.AstType == 'StringCallExpr'
+            then
+                --it's a call statement
+                local nodeCall = {}
+                nodeCall.AstType    = 'CallStatement'
+                nodeCall.Expression = suffixed
+                nodeCall.Tokens     = tokenList
+                stat = nodeCall
+            else
+                return false, GenerateError("Assignment statement expected")
+            end
+        end
+
+        if tok:IsSymbol(';') then
+            stat.Semicolon = tok:Get( stat.Tokens )
+        end
+        return true, stat
+    end
+
+
+    local statListCloseKeywords = lookupify{'end', 'else', 'elseif', 'until'}
+
+    ParseStatementList = function(scope)
+        local nodeStatlist   = {}
+        nodeStatlist.Scope   = CreateScope(scope)
+        nodeStatlist.AstType = 'Statlist'
+        nodeStatlist.Body    = { }
+        nodeStatlist.Tokens  = { }
+        --
+        --local stats = {}
+        --
+        while not statListCloseKeywords[tok:Peek().Data] and not tok:IsEof() do
+            local st, nodeStatement = ParseStatement(nodeStatlist.Scope)
+            if not st then return false, nodeStatement end
+            --stats[#stats+1] = nodeStatement
+            nodeStatlist.Body[#nodeStatlist.Body + 1] = nodeStatement
+        end
+
+        if tok:IsEof() then
+            local nodeEof = {}
+            nodeEof.AstType = 'Eof'
+            nodeEof.Tokens  = { tok:Get() }
+            nodeStatlist.Body[#nodeStatlist.Body + 1] = nodeEof
+        end
+
+        --
+        --nodeStatlist.Body = stats
+        return true, nodeStatlist
+    end
+
+
+    local function mainfunc()
+        local topScope = CreateScope()
+        return ParseStatementList(topScope)
+    end
+
+    local st, main = mainfunc()
+    return st, main
+end
+
+-- parser(syntax)
+-- Return the function parsing a source, or a token stream, into an AST,
+-- given the 'syntax' of the CPU as described above.
+M.parser = function(syntax)
+    return function(src, src_name) return ParseLua(src, src_name, syntax) end
+end
+
+-- Runs of instructions with constant operands are folded by the formatter
+-- into a single __blob() call of their bytes, pre-encoded by the CPU module,
+-- with the source line, opcode name, operands and cycles of each, see asm.lua
+-- __blob(). Each part keeps the leading whitespace of its instruction, so the
+-- lines still match. Opcodes the chunk assigns before are not folded, and
+-- __blob() calls the others when they were redefined since.
+local blob_run_max = 16 -- parts per __blob() call, within the Lua register limit
+-- Return the Lua source of string 's' on a single line.
+local blob_quote = function(s)
+    return '"' .. s:gsub('[%c"\\\128-\255]', function(c) return string.format('\\x%02x', c:byte()) end) .. '"'
+end
+local blob_white
+blob_white = function(white, s)
+    for _,token in ipairs(white) do
+        if token.LeadingWhite then blob_white(token.LeadingWhite, s) end
+        table.insert(s, token.Data)
+    end
+    return s
+end
+-- The run is written as is, as a statement of a single token.
+local blob_call = function(run)
+    local first = run[1].stat.Expression.Base.Tokens[1]
+    local s = { '__blob(_ENV' }
+    for i,part in ipairs(run) do
+        local base = part.stat.Expression.Base.Tokens[1]
+        table.insert(s, ',')
+        if i > 1 then blob_white(base.LeadingWhite, s) else table.insert(s, ' ') end
+        local code = part.code:gsub('.', function(c) return string.format('\\x%02x', c:byte()) end)
+        table.insert(s, string.format('%d, %s, %s, "%s", %d', base.Line, blob_quote(base.Data), blob_quote(part.operands), code, part.cycles))
+    end
+    table.insert(s, ')')
+    local token = { Type='Raw', Data=table.concat(s), LeadingWhite=first.LeadingWhite, Line=first.Line, Char=first.Char }
+    return { AstType='RawStatement', Tokens={token} }
+end
+-- Return the operands 'args' of a folded instruction as Lua source, also the
+-- key of its encoding.
+local blob_operand
+blob_operand = function(v)
+    if type(v) == 'string' then return blob_quote(v) end
+    if type(v) == 'table' then return v.kind .. '(' .. blob_operand(v.value) .. ')' end
+    return tostring(v)
+end
+local blob_operands = function(args)
+    local s = {}
+    for i,v in ipairs(args) do s[i] = blob_operand(v) end
+    return table.concat(s, ',')
+end
+-- Return whether the tokens of 'node' after token 'first' all sit on the
+-- line of 'first'.
+local blob_line
+blob_line = function(node, first)
+    for _,token in ipairs(node.Tokens or {}) do
+        if token ~= first then
+            if token.Line and token.Line ~= first.Line then return false end
+            for _,white in ipairs(token.LeadingWhite or {}) do
+                if white.Data:find('\n', 1, true) then return false end
+            end
+        end
+    end
+    if node.Base and not blob_line(node.Base, first) then return false end
+    for _,arg in ipairs(node.AstType ~= 'Function' and node.Arguments or {}) do
+        if not blob_line(arg, first) then return false end
+    end
+    for _,stat in ipairs(node.Body and node.Body.Body or {}) do
+        if not blob_line(stat, first) then return false end
+    end
+    return true
+end
+-- Return the bytes, cycles and operands of opcode statement 'stat' when it
+-- can be folded, with the encodings kept per opcode and operands.
+local blob_encode = function(stat, syntax, cpu, assigned)
+    if not stat.Opcode or stat.Semicolon then return end
+    local call = stat.Expression
+    local name = call.Base.Name
+    if assigned[name] or type(rawget(cpu, name)) ~= 'function' then return end
+    local args = syntax.blob_args(stat, cpu)
+    if not args then return end
+    -- the instruction must fit on its first line
+    if not blob_line(call, call.Base.Tokens[1]) then return end
+    local operands = blob_operands(args)
+    local key = name .. '(' .. operands .. ')'
+    local encoded = syntax.blob_cache[key]
+    if encoded == nil then
+        local code,cycles = syntax.blob_encode(rawget(cpu, name), args, cpu)
+        encoded = code and { code, cycles } or false
+        syntax.blob_cache[key] = encoded
+    end
+    if encoded then return encoded[1],encoded[2],operands end
+end
+local blob_fold = function(body, syntax, cpu, assigned)
+    if #body < 2 then return body end
+    local folded,run = {},{}
+    local flush = function()
+        if #run > 1 then table.insert(folded, blob_call(run))
+        elseif #run == 1 then table.insert(folded, run[1].stat) end
+        run = {}
+    end
+    for _,stat in ipairs(body) do
+        -- the names the statements before assign, as the formatter does
+        if stat.AstType == 'AssignmentStatement' then
+            for _,v in ipairs(stat.Lhs) do if v.AstType == 'VarExpr' then assigned[v.Name] = true end end
+        elseif stat.AstType == 'Function' and not stat.IsLocal and stat.Name.AstType == 'VarExpr' then
+            assigned[stat.Name.Name] = true
+        end
+        local code,cycles,operands = blob_encode(stat, syntax, cpu, assigned)
+        if code then
+            table.insert(run, { stat=stat, code=code, cycles=cycles, operands=operands })
+            if #run == blob_run_max then flush() end
+        else
+            flush()
+            table.insert(folded, stat)
+        end
+    end
+    flush()
+    return folded
+end
+
+-- Runs of byte() calls of constant values, such as dc.b tables, are compiled
+-- by the formatter into a single __bytes() call of a string constant, see
+-- asm.lua __bytes(), with the source line and size of each line of the run.
+-- The newlines of the run follow the call, so the lines still match.
+local data_min = 16 -- bytes of a run worth a string constant
+local data_counting = false -- formatting a run to count its lines
+local data_ops = {
+    ['+']=function(a,b) return a+b end, ['-']=function(a,b) return a-b end, ['*']=function(a,b) return a*b end,
+    ['&']=function(a,b) return a&b end, ['|']=function(a,b) return a|b end, ['~']=function(a,b) return a~b end,
+    ['<<']=function(a,b) return a<<b end, ['>>']=function(a,b) return a>>b end,
+    ['//']=function(a,b) if b ~= 0 then return a//b end end, ['%']=function(a,b) if b ~= 0 then return a%b end end,
+}
+local data_value
+data_value = function(expr)
+    local ast = expr.AstType
+    if ast == 'NumberExpr' then return math.tointeger(tonumber(expr.Value.Data))
+    elseif ast == 'Parentheses' then return data_value(expr.Inner)
+    elseif ast == 'UnopExpr' and (expr.Op == '-' or expr.Op == '~') then
+        local v = data_value(expr.Rhs)
+        if v then return expr.Op == '-' and -v or ~v end
+    elseif ast == 'BinopExpr' and data_ops[expr.Op] then
+        local a,b = data_value(expr.Lhs),data_value(expr.Rhs)
+        if a and b then return data_ops[expr.Op](a, b) end
+    elseif ast == 'Function' then
+        -- an encapsulated dc.b value
+        local body = expr.Body.Body
+        if #expr.Arguments == 0 and not expr.VarArg and #body == 1 and body[1].AstType == 'ReturnStatement' and #body[1].Arguments == 1 then
+            return data_value(body[1].Arguments[1])
+        end
+    end
+end
+local data_constant = function(expr, bytes)
+    if expr.AstType == 'ConstructorExpr' then
+        for _,entry in ipairs(expr.EntryList) do
+            if entry.Type ~= 'Value' then return end
+            local v = data_value(entry.Value)
+            if not v or v < -0x80 or v > 0xff then return end
+            table.insert(bytes, v & 0xff)
+        end
+        return true
+    end
+    local v = data_value(expr)
+    if not v or v < -0x80 or v > 0xff then return end
+    table.insert(bytes, v & 0xff)
+    return true
+end
+local data_encode = function(stat)
+    if stat.AstType ~= 'CallStatement' or stat.Semicolon then return end
+    local call = stat.Expression
+    if call.AstType ~= 'CallExpr' and call.AstType ~= 'TableCallExpr' then return end
+    local base = call.Base
+    if base.AstType ~= 'VarExpr' or base.Name ~= 'byte' or base.Variable and not base.Variable.IsGlobal then return end
+    local bytes = {}
+    for _,arg in ipairs(call.Arguments) do
+        if not data_constant(arg, bytes) then return end
+    end
+    return bytes
+end
+local data_call = function(run, format)
+    local token = function(type, data, white) return { Type=type, Data=data, LeadingWhite=white or {} } end
+    local first = run[1].stat.Expression.Base.Tokens[1]
+    local white = first.LeadingWhite
+    first.LeadingWhite = {}
+    local stats = {}
+    for i,part in ipairs(run) do stats[i] = part.stat end
+    data_counting = true
+    local _,lines = format{ AstType='Statlist', Body=stats }:gsub('\n', '\n')
+    data_counting = false
+    first.LeadingWhite = white
+    local chars,sizes = {},{}
+    for _,part in ipairs(run) do
+        for _,v in ipairs(part.bytes) do table.insert(chars, string.format('\\x%02x', v)) end
+        local line = part.stat.Expression.Base.Tokens[1].Line
+        local last = sizes[#sizes]
+        if last and last.line == line then last.size = last.size + #part.bytes
+        elseif #part.bytes > 0 then table.insert(sizes, { line=line, size=#part.bytes }) end
+    end
+    local code = token('String', '"' .. table.concat(chars) .. '"')
+    local entries,list = {},{ token('Symbol', '{', { token('Whitespace', ' ') }) }
+    for i,part in ipairs(sizes) do
+        for j,v in ipairs{ part.line, part.size } do
+            local number = token('Number', tostring(v), (i > 1 or j > 1) and { token('Whitespace', ' ') } or nil)
+            table.insert(entries, { Type='Value', Value={ AstType='NumberExpr', Value=number, Tokens={number} } })
+            if i < #sizes or j < 2 then table.insert(list, token('Symbol', ',')) end
+        end
+    end
+    table.insert(list, token('Symbol', '}'))
+    local tokens = { token('Symbol', '('), token('Symbol', ','), token('Symbol', ')', lines > 0 and { token('Whitespace', string.rep('\n', lines)) } or nil) }
+    local base = { AstType='VarExpr', Name='__bytes', Variable={ IsGlobal=true, Name='__bytes' }, Tokens={ token('Ident', '__bytes', white) } }
+    local args = { { AstType='StringExpr', Value=code, Tokens={code} }, { AstType='ConstructorExpr', EntryList=entries, Tokens=list } }
+    return { AstType='CallStatement', Expression={ AstType='CallExpr', Base=base, Arguments=args, Tokens=tokens }, Tokens={} }
+end
+local data_fold = function(body, format)
+    if data_counting then return body end
+    local folded,run,size = {},{},0
+    local flush = function()
+        if size >= data_min then table.insert(folded, data_call(run, format))
+        else for _,part in ipairs(run) do table.insert(folded, part.stat) end end
+        run,size = {},0
+    end
+    for _,stat in ipairs(body) do
+        local bytes = data_encode(stat)
+        if bytes then
+            table.insert(run, { stat=stat, bytes=bytes })
+            size = size + #bytes
+        else
+            flush()
+            table.insert(folded, stat)
+        end
+    end
+    flush()
+    return folded
+end
+
+-- Opcode operands of numbers and global names combined by integer arithmetic
+-- are passed as expression nodes rather than closures, see asm.lua __ref():
+-- each name becomes a __ref(_ENV, "name") call keeping the whitespace of its
+-- token, and operands of numbers only are folded into a number when they
+-- fit on their line, for blob_encode() to take them.
+local operand_ops = lookupify{ '+', '-', '*', '//', '%', '&', '|', '~', '<<', '>>' }
+local operand_names
+operand_names = function(expr, names, tokens)
+    local ast = expr.AstType
+    if ast == 'NumberExpr' then
+        table.insert(tokens, expr.Value)
+        return math.tointeger(tonumber(expr.Value.Data)) ~= nil
+    elseif ast == 'VarExpr' then
+        table.insert(tokens, expr.Tokens[1])
+        table.insert(names, expr)
+        return not expr.Variable or expr.Variable.IsGlobal
+    elseif ast == 'Parentheses' then
+        table.insert(tokens, expr.Tokens[1])
+        if not operand_names(expr.Inner, names, tokens) then return false end
+        table.insert(tokens, expr.Tokens[2])
+        return true
+    elseif ast == 'UnopExpr' then
+        table.insert(tokens, expr.Tokens[1])
+        return (expr.Op == '-' or expr.Op == '~') and operand_names(expr.Rhs, names, tokens)
+    elseif ast == 'BinopExpr' then
+        if not operand_ops[expr.Op] or not operand_names(expr.Lhs, names, tokens) then return false end
+        table.insert(tokens, expr.Tokens[1])
+        return operand_names(expr.Rhs, names, tokens)
+    end
+    return false
+end
+local operand_ref = function(var)
+    local token = function(type, data, white) return { Type=type, Data=data, LeadingWhite=white or {} } end
+    local name = token('String', string.format('%q', var.Name))
+    local args = {
+        { AstType='VarExpr', Name='_ENV', Variable={ IsGlobal=false, Name='_ENV' }, Tokens={ token('Ident', '_ENV') } },
+        { AstType='StringExpr', Value=name, Tokens={name} },
+    }
+    local base = { AstType='VarExpr', Name='__ref', Variable={ IsGlobal=true, Name='__ref' }, Tokens={ token('Ident', '__ref', var.Tokens[1].LeadingWhite) } }
+    return { AstType='CallExpr', Base=base, Arguments=args, Tokens={ token('Symbol', '('), token('Symbol', ','), token('Symbol', ')') } }
+end
+local operand_rewrite
+operand_rewrite = function(expr)
+    local ast = expr.AstType
+    if ast == 'VarExpr' then return operand_ref(expr)
+    elseif ast == 'Parentheses' then expr.Inner = operand_rewrite(expr.Inner)
+    elseif ast == 'UnopExpr' then expr.Rhs = operand_rewrite(expr.Rhs)
+    elseif ast == 'BinopExpr' then expr.Lhs,expr.Rhs = operand_rewrite(expr.Lhs),operand_rewrite(expr.Rhs)
+    end
+    return expr
+end
+
+-- operand_expr(expr)
+-- Return the expression to pass as the operand 'expr' of an opcode call in
+-- place of a closure, or nothing if it does not qualify.
+M.operand_expr = function(expr)
+    local names,tokens = {},{}
+    if not operand_names(expr, names, tokens) then return end
+    if #names > 0 then return operand_rewrite(expr) end
+    local v = data_value(expr)
+    if not v then return end
+    for i=2,#tokens do
+        for _,white in ipairs(tokens[i].LeadingWhite or {}) do
+            if white.Type ~= 'Whitespace' or white.Data:find('\n') then return expr end
+        end
+    end
+    local value = { Type='Number', Data=tostring(v), LeadingWhite=tokens[1].LeadingWhite }
+    return { AstType='NumberExpr', Value=value, Tokens={value} }
+end
+
+local function format(ast, bare, syntax)
+    local formatStatlist, formatExpr
+    -- names the chunk assigns, whose opcode calls are not folded
+    local assigned = {}
+    local cpu = require(syntax.cpu)
+    local format_bare = function(ast) return format(ast, true, syntax) end
+    -- tokens keep their leading whitespace and comments, so each generated line
+    -- is its source line and errors in the chunk map back as is
+    local find = string.find
+    local out = {
+        rope = {},    -- List of strings
+        n = 0,        -- strings in rope
+        line = 1,     -- generated line, which is also the source line
+
+        appendStr = function(self, str)
+            local n = self.n + 1
+            self.rope[n] = str
+            self.n = n
+            local nl = find(str, '\n', 1, true)
+            while nl do
+                self.line = self.line + 1
+                nl = find(str, '\n', nl+1, true)
+            end
+        end,
+
+        appendToken = function(self, token)
+            local white = token.LeadingWhite
+            if white then
+                for i=1,#white do self:appendToken(white[i]) end
+            end
+            self:appendStr(token.Data)
+        end,
+
+        appendTokens = function(self, tokens)
+            for i=1,#tokens do self:appendToken(tokens[i]) end
+        end,
+
+        appendWhite = function(self, token)
+            if token.LeadingWhite then
+                self:appendTokens( token.LeadingWhite )
+            end
+        end
+    }
+    formatExpr = function(expr)
+        local tok_it = 1
+        local function appendNextToken(str)
+            local tok = expr.Tokens[tok_it];
+            if str and tok.Data ~= str then
+                error("Expected token '" .. str .. "' at line " .. out.line .. ".")
+            end
+            out:appendToken( tok )
+            tok_it = tok_it + 1
+        end
+        local function appendToken(token)
+            out:appendToken( token )
+            tok_it = tok_it + 1
+        end
+        local function appendWhite()
+            local tok = expr.Tokens[tok_it];
+            if not tok then error("Missing token at line " .. out.line) end
+            out:appendWhite( tok )
+            tok_it = tok_it + 1
+        end
+        local function appendStr(str)
+            appendWhite()
+            out:appendStr(str)
+        end
+        local function peek()
+            if tok_it < #expr.Tokens then
+                return expr.Tokens[tok_it].Data
+            end
+        end
+        local function appendComma(mandatory, seperators)
+            seperators = seperators or { "," }
+            seperators = lookupify( seperators )
+            if not mandatory and not seperators[peek()] then
+                return
+            end
+            assert(seperators[peek()], "Missing comma or semicolon")
+            appendNextToken()
+        end
+
+        if expr.AstType == 'VarExpr' then
+            if expr.Variable then
+                appendStr( expr.Variable.Name )
+            else
+                appendStr( expr.Name )
+            end
+
+        elseif expr.AstType == 'NumberExpr' then
+            appendToken( expr.Value )
+
+        elseif expr.AstType == 'StringExpr' then
+            appendToken( expr.Value )
+
+        elseif expr.AstType == 'BooleanExpr' then
+            appendNextToken( expr.Value and "true" or "false" )
+
+        elseif expr.AstType == 'NilExpr' then
+            appendNextToken( "nil" )
+
+        elseif expr.AstType == 'BinopExpr' then
+            formatExpr(expr.Lhs)
+            appendStr( expr.Op )
+            formatExpr(expr.Rhs)
+
+        elseif expr.AstType == 'UnopExpr' then
+            appendStr( expr.Op )
+            formatExpr(expr.Rhs)
+
+        elseif expr.AstType == 'DotsExpr' then
+            appendNextToken( "..." )
+
+        elseif expr.AstType == 'CallExpr' then
+            formatExpr(expr.Base)
+            appendNextToken( "(" )
+            for i,arg in ipairs( expr.Arguments ) do
+                formatExpr(arg)
+                appendComma( i ~= #expr.Arguments )
+            end
+            appendNextToken( ")" )
+
+        elseif expr.AstType == 'TableCallExpr' then
+            formatExpr( expr.Base )
+            formatExpr( expr.Arguments[1] )
+
+        elseif expr.AstType == 'StringCallExpr' then
+            formatExpr(expr.Base)
+            appendToken( expr.Arguments[1] )
+
+        elseif expr.AstType == 'IndexExpr' then
+            formatExpr(expr.Base)
+            appendNextToken( "[" )
+            formatExpr(expr.Index)
+            appendNextToken( "]" )
+
+        elseif expr.AstType == 'MemberExpr' then
+            formatExpr(expr.Base)
+            appendNextToken()  -- . or :
+            appendToken(expr.Ident)
+
+        elseif expr.AstType == 'Function' then
+            -- anonymous function
+            appendNextToken( "function" )
+            appendNextToken( "(" )
+            if #expr.Arguments > 0 then
+                for i = 1, #expr.Arguments do
+                    appendStr( expr.Arguments[i].Name )
+                    if i ~= #expr.Arguments then
+                        appendNextToken(",")
+                    elseif expr.VarArg then
+                        appendNextToken(",")
+                        appendNextToken("...")
+                    end
+                end
+            elseif expr.VarArg then
+                appendNextToken("...")
+            end
+            appendNextToken(")")
+            formatStatlist(expr.Body)
+            appendNextToken("end")
+
+        elseif expr.AstType == 'ConstructorExpr' then
+            appendNextToken( "{" )
+            for i = 1, #expr.EntryList do
+                local entry = expr.EntryList[i]
+                if entry.Type == 'Key' then
+                    appendNextToken( "[" )
+                    formatExpr(entry.Key)
+                    appendNextToken( "]" )
+                    appendNextToken( "=" )
+                    formatExpr(entry.Value)
+                elseif entry.Type == 'Value' then
+                    formatExpr(entry.Value)
+                elseif entry.Type == 'KeyString' then
+                    appendStr(entry.Key)
+                    appendNextToken( "=" )
+                    formatExpr(entry.Value)
+                end
+                appendComma( i ~= #expr.EntryList, { ",", ";" } )
+            end
+            appendNextToken( "}" )
+
+        elseif expr.AstType == 'Parentheses' then
+            appendNextToken( "(" )
+            formatExpr(expr.Inner)
+            appendNextToken( ")" )
+
+        else
+            error(string.format("Unknown AST Type: %s\n", tostring(statement.AstType)))
+        end
+
+        assert(tok_it == #expr.Tokens + 1)
+    end
+
+
+    local formatStatement = function(statement)
+        local tok_it = 1
+        local function appendNextToken(str)
+            local tok = statement.Tokens[tok_it];
+            assert(tok, string.format("Not enough tokens for %q. First token at %i:%i",
+                str, statement.Tokens[1].Line, statement.Tokens[1].Char))
+            assert(tok.Data == str,
+                string.format('Expected token %q, got %q', str, tok.Data))
+            out:appendToken( tok )
+            tok_it = tok_it + 1
+        end
+        local function appendToken(token)
+            out:appendToken( str )
+            tok_it = tok_it + 1
+        end
+        local function appendWhite()
+            local tok = statement.Tokens[tok_it];
+            out:appendWhite( tok )
+            tok_it = tok_it + 1
+        end
+        local function appendStr(str)
+            appendWhite()
+            out:appendStr(str)
+        end
+        local function appendComma(mandatory)
+            if mandatory
+               or (tok_it < #statement.Tokens and statement.Tokens[tok_it].Data == ",") then
+               appendNextToken( "," )
+            end
+        end
+
+        if statement.AstType == 'AssignmentStatement' then
+            for i,v in ipairs(statement.Lhs) do
+                if v.AstType == 'VarExpr' then assigned[v.Name] = true end
+                formatExpr(v)
+                appendComma( i ~= #statement.Lhs )
+            end
+            if #statement.Rhs > 0 then
+                appendNextToken( "=" )
+                for i,v in ipairs(statement.Rhs) do
+                    formatExpr(v)
+                    appendComma( i ~= #statement.Rhs )
+                end
+            end
+
+        elseif statement.AstType == 'CallStatement' then
+            formatExpr(statement.Expression)
+
+        elseif statement.AstType == 'LocalStatement' then
+            appendNextToken( "local" )
+            for i = 1, #statement.LocalList do
+                appendStr( statement.LocalList[i].Name )
+                appendComma( i ~= #statement.LocalList )
+            end
+            if #statement.InitList > 0 then
+                appendNextToken( "=" )
+                for i = 1, #statement.InitList do
+                    formatExpr(statement.InitList[i])
+                    appendComma( i ~= #statement.InitList )
+                end
+            end
+
+        elseif statement.AstType == 'IfStatement' then
+            appendNextToken( "if" )
+            formatExpr( statement.Clauses[1].Condition )
+            appendNextToken( "then" )
+            formatStatlist( statement.Clauses[1].Body )
+            for i = 2, #statement.Clauses do
+                local st = statement.Clauses[i]
+                if st.Condition then
+                    appendNextToken( "elseif" )
+                    formatExpr(st.Condition)
+                    appendNextToken( "then" )
+                else
+                    appendNextToken( "else" )
+                end
+                formatStatlist(st.Body)
+            end
+            appendNextToken( "end" )
+
+        elseif statement.AstType == 'WhileStatement' then
+            appendNextToken( "while" )
+            formatExpr(statement.Condition)
+            appendNextToken( "do" )
+            formatStatlist(statement.Body)
+            appendNextToken( "end" )
+
+        elseif statement.AstType == 'DoStatement' then
+            appendNextToken( "do" )
+            formatStatlist(statement.Body)
+            appendNextToken( "end" )
+
+        elseif statement.AstType == 'ReturnStatement' then
+            appendNextToken( "return" )
+            if statement.TrailingWhite then out:appendStr(' ') end
+            for i = 1, #statement.Arguments do
+                formatExpr(statement.Arguments[i])
+                appendComma( i ~= #statement.Arguments )
+            end
+
+        elseif statement.AstType == 'BreakStatement' then
+            appendNextToken( "break" )
+
+        elseif statement.AstType == 'RepeatStatement' then
+            appendNextToken( "repeat" )
+            formatStatlist(statement.Body)
+            appendNextToken( "until" )
+            formatExpr(statement.Condition)
+
+        elseif statement.AstType == 'Function' then
+            if statement.IsLocal then
+                appendNextToken( "local" )
+            end
+            appendNextToken( "function" )
+
+            if statement.IsLocal then
+                appendStr(statement.Name.Name)
+            else
+                formatExpr(statement.Name)
+                if statement.Name.AstType == 'VarExpr' then assigned[statement.Name.Name] = true end
+            end
+
+            appendNextToken( "(" )
+            if #statement.Arguments > 0 then
+                for i = 1, #statement.Arguments do
+                    appendStr( statement.Arguments[i].Name )
+                    appendComma( i ~= #statement.Arguments or statement.VarArg )
+                    if i == #statement.Arguments and statement.VarArg then
+                        appendNextToken( "..." )
+                    end
+                end
+            elseif statement.VarArg then
+                appendNextToken( "..." )
+            end
+            appendNextToken( ")" )
+
+            formatStatlist(statement.Body)
+            appendNextToken( "end" )
+
+        elseif statement.AstType == 'GenericForStatement' then
+            appendNextToken( "for" )
+            for i = 1, #statement.VariableList do
+                appendStr( statement.VariableList[i].Name )
+                appendComma( i ~= #statement.VariableList )
+            end
+            appendNextToken( "in" )
+            for i = 1, #statement.Generators do
+                formatExpr(statement.Generators[i])
+                appendComma( i ~= #statement.Generators )
+            end
+            appendNextToken( "do" )
+            formatStatlist(statement.Body)
+            appendNextToken( "end" )
+
+        elseif statement.AstType == 'NumericForStatement' then
+            appendNextToken( "for" )
+            appendStr( statement.Variable.Name )
+            appendNextToken( "=" )
+            formatExpr(statement.Start)
+            appendNextToken( "," )
+            formatExpr(statement.End)
+            if statement.Step then
+                appendNextToken( "," )
+                formatExpr(statement.Step)
+            end
+            appendNextToken( "do" )
+            formatStatlist(statement.Body)
+            appendNextToken( "end" )
+
+        elseif statement.AstType == 'LabelStatement' then
+            appendNextToken( "::" )
+            appendStr( statement.Label )
+            appendNextToken( "::" )
+
+        elseif statement.AstType == 'GotoStatement' then
+            appendNextToken( "goto" )
+            appendStr( statement.Label )
+
+        elseif statement.AstType == 'Eof' then
+            appendWhite()
+
+        elseif statement.AstType == 'RawStatement' then
+            appendNextToken(statement.Tokens[1].Data)
+
+        elseif statement.AstType == 'SemicolonStatement' then
+
+        else
+            error(string.format("Unknown AST Type: %s\n", tostring(statement.AstType)))
+        end
+
+        if statement.Semicolon then
+            appendNextToken(";")
+        end
+
+        assert(tok_it == #statement.Tokens + 1)
+    end
+
+    formatStatlist = function(statList)
+        local body = data_fold(statList.Body, format_bare)
+        if not bare then body = blob_fold(body, syntax, cpu, assigned) end
+        for _, stat in ipairs(body) do
+            formatStatement(stat)
+        end
+    end
+
+    formatStatlist(ast)
+    
+    return table.concat(out.rope)
+end
+
+-- formatter(syntax)
+-- Return the function formatting an AST into Lua source, given the 'syntax'
+-- of the parser: 'cpu', the name of its CPU module, 'blob_args', which
+-- returns the constant operands of an opcode statement it can pre-encode,
+-- and 'blob_encode', which returns the bytes and cycles of an opcode
+-- function called with such operands.
+M.formatter = function(syntax)
+    syntax.blob_cache = {}
+    return function(ast, bare) return format(ast, bare, syntax) end
+end
+
+return M
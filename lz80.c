@@ -145,6 +145,7 @@ static struct script { const char *name; int t;  const char *data; size_t sz; }
     SRC_LUA(dkjson),
     SRC_LUA(l65cfg),
     SRC_LUA(re),
+    SRC_LUA(simsm83),
     SRC_LZ80(gb),
     SRC_LZ80(hUGEDriver),
 };
@@ -193,6 +194,8 @@ int main(int argc, char *argv[])
     lua_setfield(L, -2, "asm");
     luaL_loadbufferx(L, script_z80_lua, sizeof(script_z80_lua), "z80.lua", "b");
     lua_setfield(L, -2, "z80");
+    luaL_loadbufferx(L, script_lfront_lua, sizeof(script_lfront_lua), "lfront.lua", "b");
+    lua_setfield(L, -2, "lfront");
     lua_pop(L, 1);
 
     // error handler
@@ -145,6 +145,7 @@ static struct script { const char *name; int t;  const char *data; size_t sz; }
     SRC_LUA(dkjson),
     SRC_LUA(l65cfg),
     SRC_LUA(re),
+    SRC_LUA(sim6502),
     SRC_L65(nes),
     SRC_L65(vcs),
 };
@@ -193,6 +194,8 @@ int main(int argc, char *argv[])
     lua_setfield(L, -2, "asm");
     luaL_loadbufferx(L, script_6502_lua, sizeof(script_6502_lua), "6502.lua", "b");
     lua_setfield(L, -2, "6502");
+    luaL_loadbufferx(L, script_lfront_lua, sizeof(script_lfront_lua), "lfront.lua", "b");
+    lua_setfield(L, -2, "lfront");
     lua_pop(L, 1);
 
     // error handler
@@ -0,0 +1,269 @@
+-- Cycle counting NMOS 6502 core, used by bench() and fastest() in asm.lua.
+-- Opcodes, base cycles and page crossing penalties come from the 6502.lua
+-- opcode tables, so everything the assembler emits runs, illegal opcodes
+-- included. Interrupts are not simulated.
+local cpu = require "6502"
+
+local C,Z,I,D,B,U,V,N = 0x01,0x02,0x04,0x08,0x10,0x20,0x40,0x80
+
+local S = {}
+S.__index = S
+S.ret,S.ret_cycles = { 0x60 },6 -- appended to code run by fastest()
+
+-- Return a new core with 64KB of zeroed RAM.
+S.new = function()
+    return setmetatable({ a=0, x=0, y=0, s=0xfd, p=U|I, pc=0, cycles=0, limit=10000000,
+        mem={}, readers={}, writers={} }, S)
+end
+
+S.read = function(s, a)
+    local r = s.readers[a>>8]
+    if r then return r(a) end
+    return s.mem[a] or 0
+end
+S.write = function(s, a, v)
+    local w = s.writers[a>>8]
+    if w then return w(a, v) end
+    s.mem[a] = v
+end
+
+-- Route accesses to addresses [first, last] to read(address) and
+-- write(address, value) instead of RAM; either may be nil. Later maps take
+-- precedence over earlier ones.
+S.map = function(s, first, last, read, write)
+    local mem = s.mem
+    for page=first>>8,last>>8 do
+        local r,w = s.readers[page],s.writers[page]
+        if read then s.readers[page] = function(a)
+            if a >= first and a <= last then return read(a) end
+            if r then return r(a) end
+            return mem[a] or 0
+        end end
+        if write then s.writers[page] = function(a, v)
+            if a >= first and a <= last then return write(a, v) end
+            if w then return w(a, v) end
+            mem[a] = v
+        end end
+    end
+end
+
+-- Copy 'location' bytes from 'bin' as returned by genbin() to RAM at
+-- their CPU addresses.
+S.load = function(s, bin, location)
+    local of0,mem,rorg = cpu.locations[1].start,s.mem,location.rorg
+    local last = math.min(location.finish or math.huge, #bin+of0-1)
+    for address=location.start,last do mem[rorg(address) & 0xffff] = bin[address-of0+1] end
+end
+
+local push = function(s, v) s:write(0x100 | s.s, v) s.s = (s.s-1) & 0xff end
+local pull = function(s) s.s = (s.s+1) & 0xff return s:read(0x100 | s.s) end
+local nz = function(s, v) s.p = s.p & ~(N|Z) | v & N | (v == 0 and Z or 0) return v end
+local word = function(s, a) return s:read(a) | s:read((a+1) & 0xffff)<<8 end
+local wordzp = function(s, a) return s:read(a) | s:read((a+1) & 0xff)<<8 end
+local fetch = function(s) local v = s:read(s.pc) s.pc = (s.pc+1) & 0xffff return v end
+local fetchw = function(s) local v = word(s, s.pc) s.pc = (s.pc+2) & 0xffff return v end
+
+-- addressing modes return the effective address and whether indexing crossed a page
+local indexed = function(base, i) local a = (base+i) & 0xffff return a, (a ~ base) & 0xff00 ~= 0 end
+local modes = {
+    imp = function(s) end,
+    imm = function(s) local a = s.pc s.pc = (a+1) & 0xffff return a end,
+    zpg = function(s) return fetch(s) end,
+    zpx = function(s) return (fetch(s) + s.x) & 0xff end,
+    zpy = function(s) return (fetch(s) + s.y) & 0xff end,
+    abs = function(s) return fetchw(s) end,
+    abx = function(s) return indexed(fetchw(s), s.x) end,
+    aby = function(s) return indexed(fetchw(s), s.y) end,
+    -- the pointer high byte does not carry into the next page
+    ind = function(s) local p = fetchw(s) return s:read(p) | s:read(p & 0xff00 | (p+1) & 0xff)<<8 end,
+    inx = function(s) return wordzp(s, (fetch(s) + s.x) & 0xff) end,
+    iny = function(s) return indexed(wordzp(s, fetch(s)), s.y) end,
+    rel = function(s) local o = fetch(s) return (s.pc + (o ~ 0x80) - 0x80) & 0xffff end,
+}
+
+local compare = function(s, r, v)
+    local d = r - v
+    s.p = s.p & ~C | (d >= 0 and C or 0)
+    nz(s, d & 0xff)
+end
+local adc = function(s, v)
+    local a,c = s.a,s.p & C
+    local r = a + v + c
+    local p = s.p & ~(N|V|Z|C)
+    if r & 0xff == 0 then p = p | Z end
+    if s.p & D == 0 then
+        if r > 0xff then p = p | C end
+        if ~(a ~ v) & (a ~ r) & 0x80 ~= 0 then p = p | V end
+        s.a,s.p = r & 0xff,p | r & N
+        return
+    end
+    -- NMOS decimal mode: Z from the binary sum, N and V from the high digit before adjust
+    local lo = (a & 0x0f) + (v & 0x0f) + c
+    if lo > 9 then lo = lo + 6 end
+    local hi = (a >> 4) + (v >> 4) + (lo > 0x0f and 1 or 0)
+    if hi & 8 ~= 0 then p = p | N end
+    if ~(a ~ v) & (a ~ hi<<4) & 0x80 ~= 0 then p = p | V end
+    if hi > 9 then hi = hi + 6 end
+    if hi > 0x0f then p = p | C end
+    s.a,s.p = (hi<<4 | lo & 0x0f) & 0xff,p
+end
+local sbc = function(s, v)
+    local a,b = s.a,1 - (s.p & C)
+    local r = a - v - b
+    local p = s.p & ~(N|V|Z|C)
+    if r >= 0 then p = p | C end
+    if (a ~ v) & (a ~ r) & 0x80 ~= 0 then p = p | V end
+    s.p = p | r & N | (r & 0xff == 0 and Z or 0)
+    if s.p & D == 0 then s.a = r & 0xff return end
+    -- NMOS decimal mode: flags from the binary difference
+    local lo = (a & 0x0f) - (v & 0x0f) - b
+    local hi = (a >> 4) - (v >> 4) - (lo < 0 and 1 or 0)
+    if lo < 0 then lo = lo - 6 end
+    if hi < 0 then hi = hi - 6 end
+    s.a = (hi<<4 | lo & 0x0f) & 0xff
+end
+
+-- read-modify-write helpers, on A when the address is nil (implied mode)
+local rmw = function(f) return function(s, a)
+    if not a then s.a = nz(s, f(s, s.a)) return end
+    local v = f(s, s:read(a))
+    s:write(a, v)
+    return nz(s, v)
+end end
+local asl = rmw(function(s, v) s.p = s.p & ~C | v >> 7 return v << 1 & 0xff end)
+local lsr = rmw(function(s, v) s.p = s.p & ~C | v & 1 return v >> 1 end)
+local rol = rmw(function(s, v) local c = s.p & C s.p = s.p & ~C | v >> 7 return (v << 1 | c) & 0xff end)
+local ror = rmw(function(s, v) local c = s.p & C s.p = s.p & ~C | v & 1 return v >> 1 | c << 7 end)
+local inc = rmw(function(s, v) return (v+1) & 0xff end)
+local dec = rmw(function(s, v) return (v-1) & 0xff end)
+
+-- taken branches cost one cycle, two when crossing a page
+local branch = function(flag, set) return function(s, a)
+    if (s.p & flag ~= 0) ~= set then return end
+    local pc = s.pc
+    s.pc = a
+    return (pc ~ a) & 0xff00 == 0 and 1 or 2
+end end
+
+-- unstable opcodes use the common magic constant for A in ane
+local ops = {
+    adc = function(s, a) adc(s, s:read(a)) end,
+    ['and'] = function(s, a) s.a = nz(s, s.a & s:read(a)) end,
+    asl = asl,
+    bcc = branch(C, false), bcs = branch(C, true), beq = branch(Z, true), bmi = branch(N, true),
+    bne = branch(Z, false), bpl = branch(N, false), bvc = branch(V, false), bvs = branch(V, true),
+    bit = function(s, a) local v = s:read(a) s.p = s.p & ~(N|V|Z) | v & (N|V) | (s.a & v == 0 and Z or 0) end,
+    brk = function(s)
+        s.pc = (s.pc+1) & 0xffff
+        push(s, s.pc >> 8) push(s, s.pc & 0xff) push(s, s.p | B | U)
+        s.p = s.p | I
+        s.pc = word(s, 0xfffe)
+    end,
+    clc = function(s) s.p = s.p & ~C end,
+    cld = function(s) s.p = s.p & ~D end,
+    cli = function(s) s.p = s.p & ~I end,
+    clv = function(s) s.p = s.p & ~V end,
+    cmp = function(s, a) compare(s, s.a, s:read(a)) end,
+    cpx = function(s, a) compare(s, s.x, s:read(a)) end,
+    cpy = function(s, a) compare(s, s.y, s:read(a)) end,
+    dec = dec,
+    dex = function(s) s.x = nz(s, (s.x-1) & 0xff) end,
+    dey = function(s) s.y = nz(s, (s.y-1) & 0xff) end,
+    eor = function(s, a) s.a = nz(s, s.a ~ s:read(a)) end,
+    inc = inc,
+    inx = function(s) s.x = nz(s, (s.x+1) & 0xff) end,
+    iny = function(s) s.y = nz(s, (s.y+1) & 0xff) end,
+    jmp = function(s, a) s.pc = a end,
+    jsr = function(s, a) local r = (s.pc-1) & 0xffff push(s, r >> 8) push(s, r & 0xff) s.pc = a end,
+    lda = function(s, a) s.a = nz(s, s:read(a)) end,
+    ldx = function(s, a) s.x = nz(s, s:read(a)) end,
+    ldy = function(s, a) s.y = nz(s, s:read(a)) end,
+    lsr = lsr,
+    nop = function(s, a) if a then s:read(a) end end,
+    ora = function(s, a) s.a = nz(s, s.a | s:read(a)) end,
+    pha = function(s) push(s, s.a) end,
+    php = function(s) push(s, s.p | B | U) end,
+    pla = function(s) s.a = nz(s, pull(s)) end,
+    plp = function(s) s.p = pull(s) & ~B | U end,
+    rol = rol,
+    ror = ror,
+    rti = function(s) s.p = pull(s) & ~B | U s.pc = pull(s) | pull(s)<<8 end,
+    rts = function(s) s.pc = ((pull(s) | pull(s)<<8) + 1) & 0xffff end,
+    sbc = function(s, a) sbc(s, s:read(a)) end,
+    sec = function(s) s.p = s.p | C end,
+    sed = function(s) s.p = s.p | D end,
+    sei = function(s) s.p = s.p | I end,
+    sta = function(s, a) s:write(a, s.a) end,
+    stx = function(s, a) s:write(a, s.x) end,
+    sty = function(s, a) s:write(a, s.y) end,
+    tax = function(s) s.x = nz(s, s.a) end,
+    tay = function(s) s.y = nz(s, s.a) end,
+    tsx = function(s) s.x = nz(s, s.s) end,
+    txa = function(s) s.a = nz(s, s.x) end,
+    txs = function(s) s.s = s.x end,
+    tya = function(s) s.a = nz(s, s.y) end,
+    -- illegal opcodes
+    anc = function(s, a) s.a = nz(s, s.a & s:read(a)) s.p = s.p & ~C | s.a >> 7 end,
+    ane = function(s, a) s.a = nz(s, (s.a | 0xee) & s.x & s:read(a)) end,
+    arr = function(s, a)
+        local v = s.a & s:read(a)
+        v = nz(s, v >> 1 | (s.p & C) << 7)
+        s.a = v
+        s.p = s.p & ~(C|V) | v >> 6 & 1 | ((v >> 6 ~ v >> 5) & 1) << 6
+    end,
+    asr = function(s, a) s.a = s.a & s:read(a) lsr(s) end,
+    dcp = function(s, a) compare(s, s.a, dec(s, a)) end,
+    isb = function(s, a) sbc(s, inc(s, a)) end,
+    jam = function(s) error(string.format("jam opcode at %04x", (s.pc-1) & 0xffff), 0) end,
+    las = function(s, a) local v = nz(s, s:read(a) & s.s) s.a,s.x,s.s = v,v,v end,
+    lax = function(s, a) local v = nz(s, s:read(a)) s.a,s.x = v,v end,
+    rla = function(s, a) s.a = nz(s, s.a & rol(s, a)) end,
+    rra = function(s, a) adc(s, ror(s, a)) end,
+    sax = function(s, a) s:write(a, s.a & s.x) end,
+    sbx = function(s, a) local v = s.a & s.x compare(s, v, s:read(a)) s.x = (v - s:read(a)) & 0xff end,
+    sha = function(s, a) s:write(a, s.a & s.x & ((a >> 8) + 1) & 0xff) end,
+    shs = function(s, a) s.s = s.a & s.x s:write(a, s.s & ((a >> 8) + 1) & 0xff) end,
+    shx = function(s, a) s:write(a, s.x & ((a >> 8) + 1) & 0xff) end,
+    shy = function(s, a) s:write(a, s.y & ((a >> 8) + 1) & 0xff) end,
+    slo = function(s, a) s.a = nz(s, s.a | asl(s, a)) end,
+    sre = function(s, a) s.a = nz(s, s.a ~ lsr(s, a)) end,
+}
+
+-- opcode -> { exec, mode, cycles, xcross }
+local decode = {}
+for mode,t in pairs{ imp=cpu.opimp, imm=cpu.opimm, zpg=cpu.opzpg, zpx=cpu.opzpx, zpy=cpu.opzpy, abs=cpu.opabs,
+        abx=cpu.opabx, aby=cpu.opaby, ind=cpu.opind, inx=cpu.opinx, iny=cpu.opiny, rel=cpu.oprel } do
+    for k,v in pairs(t) do
+        decode[v.opc] = { ops[k] or error("no simulation for " .. k), modes[mode], v.cycles, v.xcross or 0 }
+    end
+end
+S.decode = decode
+
+-- Execute one instruction, return the cycles it took.
+S.step = function(s)
+    local opc = s:read(s.pc)
+    local d = decode[opc]
+    if not d then error(string.format("unknown opcode %02x at %04x", opc, s.pc), 0) end
+    s.pc = (s.pc+1) & 0xffff
+    local a,cross = d[2](s)
+    local cycles = d[3] + (d[1](s, a) or 0) + (cross and d[4] or 0)
+    s.cycles = s.cycles + cycles
+    return cycles
+end
+
+-- Call the subroutine at 'address' as jsr would and run it until it
+-- returns, return the cycles it took, including its rts.
+S.call = function(s, address)
+    local s0,start = s.s,s.cycles
+    push(s, 0xff) push(s, 0xff)
+    s.pc = address
+    repeat
+        s:step()
+        if s.cycles - start > s.limit then
+            error(string.format("subroutine at %04x still running after %d cycles, at %04x", address, s.limit, s.pc), 0)
+        end
+    until s.pc == 0 and s.s == s0
+    return s.cycles - start
+end
+
+return S
@@ -0,0 +1,263 @@
+-- Cycle counting Game Boy SM83 core, used by bench() and fastest() in
+-- asm.lua. Cycles are clock cycles (4 per machine cycle), as in z80.lua.
+-- Interrupts, halt and stop are not simulated.
+
+local Z,N,H,C = 0x80,0x40,0x20,0x10
+
+local S = {}
+S.__index = S
+S.ret,S.ret_cycles = { 0xc9 },16 -- appended to code run by fastest()
+
+-- Return a new core with 64KB of zeroed RAM.
+S.new = function()
+    return setmetatable({ a=0, f=0, b=0, c=0, d=0, e=0, h=0, l=0, sp=0xfffe, pc=0, cycles=0, limit=10000000,
+        mem={}, readers={}, writers={} }, S)
+end
+
+S.read = function(s, a)
+    local r = s.readers[a>>8]
+    if r then return r(a) end
+    return s.mem[a] or 0
+end
+S.write = function(s, a, v)
+    local w = s.writers[a>>8]
+    if w then return w(a, v) end
+    s.mem[a] = v
+end
+
+-- Route accesses to addresses [first, last] to read(address) and
+-- write(address, value) instead of RAM; either may be nil.
+S.map = function(s, first, last, read, write)
+    local mem = s.mem
+    for page=first>>8,last>>8 do
+        local r,w = s.readers[page],s.writers[page]
+        if read then s.readers[page] = function(a)
+            if a >= first and a <= last then return read(a) end
+            if r then return r(a) end
+            return mem[a] or 0
+        end end
+        if write then s.writers[page] = function(a, v)
+            if a >= first and a <= last then return write(a, v) end
+            if w then return w(a, v) end
+            mem[a] = v
+        end end
+    end
+end
+
+-- Copy 'location' bytes from 'bin' as returned by genbin() to RAM at
+-- their CPU addresses.
+S.load = function(s, bin, location)
+    local of0,mem,rorg = require"asm".locations[1].start,s.mem,location.rorg
+    local last = math.min(location.finish or math.huge, #bin+of0-1)
+    for address=location.start,last do mem[rorg(address) & 0xffff] = bin[address-of0+1] end
+end
+
+-- Get the register pair 'name' ('af', 'bc', 'de', 'hl'), or set it to 'value'.
+S.pair = function(s, name, value)
+    local hi,lo = name:sub(1,1),name:sub(2,2)
+    if value == nil then return s[hi]<<8 | s[lo] end
+    s[hi],s[lo] = value>>8 & 0xff,value & (name == 'af' and 0xf0 or 0xff)
+end
+
+local fetch = function(s) local v = s:read(s.pc) s.pc = (s.pc+1) & 0xffff return v end
+local fetchw = function(s) local v = fetch(s) return v | fetch(s)<<8 end
+local push = function(s, v) s.sp = (s.sp-1) & 0xffff s:write(s.sp, v>>8) s.sp = (s.sp-1) & 0xffff s:write(s.sp, v & 0xff) end
+local pull = function(s) local v = s:read(s.sp) | s:read((s.sp+1) & 0xffff)<<8 s.sp = (s.sp+2) & 0xffff return v end
+local hl = function(s) return s.h<<8 | s.l end
+local sethl = function(s, v) s.h,s.l = v>>8 & 0xff,v & 0xff end
+local signed = function(v) return (v ~ 0x80) - 0x80 end
+
+-- 8-bit operands in opcode order, 6 being (hl)
+local r8 = { [0]='b', 'c', 'd', 'e', 'h', 'l', false, 'a' }
+local get = function(s, i) local r = r8[i] if r then return s[r] end return s:read(hl(s)) end
+local set = function(s, i, v) local r = r8[i] if r then s[r] = v else s:write(hl(s), v) end end
+-- 16-bit operands of ld/inc/dec/add and push/pop
+local rp = { [0]='bc', 'de', 'hl', 'sp' }
+local getrp = function(s, i) if i == 3 then return s.sp end return s:pair(rp[i]) end
+local setrp = function(s, i, v) if i == 3 then s.sp = v & 0xffff else s:pair(rp[i], v & 0xffff) end end
+local rp2 = { [0]='bc', 'de', 'hl', 'af' }
+local cond = function(s, i)
+    if i == 0 then return s.f & Z == 0 elseif i == 1 then return s.f & Z ~= 0
+    elseif i == 2 then return s.f & C == 0 end return s.f & C ~= 0
+end
+
+local alu = {
+    [0] = function(s, v, c) -- add
+        c = c or 0
+        local r = s.a + v + c
+        s.f = (r & 0xff == 0 and Z or 0) | ((s.a & 0xf) + (v & 0xf) + c > 0xf and H or 0) | (r > 0xff and C or 0)
+        s.a = r & 0xff
+    end,
+    function(s, v, c) s.alu[0](s, v, s.f >> 4 & 1) end, -- adc
+    function(s, v, c) -- sub
+        c = c or 0
+        local r = s.a - v - c
+        s.f = N | (r & 0xff == 0 and Z or 0) | ((s.a & 0xf) - (v & 0xf) - c < 0 and H or 0) | (r < 0 and C or 0)
+        s.a = r & 0xff
+    end,
+    function(s, v) s.alu[2](s, v, s.f >> 4 & 1) end, -- sbc
+    function(s, v) s.a = s.a & v s.f = H | (s.a == 0 and Z or 0) end, -- and
+    function(s, v) s.a = s.a ~ v s.f = s.a == 0 and Z or 0 end, -- xor
+    function(s, v) s.a = s.a | v s.f = s.a == 0 and Z or 0 end, -- or
+    function(s, v) local a = s.a s.alu[2](s, v) s.a = a end, -- cp
+}
+S.alu = alu
+
+-- cb prefixed rotations and shifts, returning the result and carry
+local shift = {
+    [0] = function(v) return (v << 1 | v >> 7) & 0xff, v >> 7 end, -- rlc
+    function(v) return (v >> 1 | v << 7) & 0xff, v & 1 end, -- rrc
+    function(v, c) return (v << 1 | c) & 0xff, v >> 7 end, -- rl
+    function(v, c) return v >> 1 | c << 7, v & 1 end, -- rr
+    function(v) return v << 1 & 0xff, v >> 7 end, -- sla
+    function(v) return v >> 1 | v & 0x80, v & 1 end, -- sra
+    function(v) return (v << 4 | v >> 4) & 0xff, 0 end, -- swap
+    function(v) return v >> 1, v & 1 end, -- srl
+}
+local cb = function(s)
+    local opc = fetch(s)
+    local i,x,y = opc & 7,opc >> 6,opc >> 3 & 7
+    local v = get(s, i)
+    if x == 0 then
+        local r,c = shift[y](v, s.f >> 4 & 1)
+        set(s, i, r)
+        s.f = (r == 0 and Z or 0) | (c == 1 and C or 0)
+    elseif x == 1 then
+        s.f = s.f & C | H | (v & 1 << y == 0 and Z or 0)
+        return i == 6 and 12 or 8
+    else
+        set(s, i, x == 2 and v & ~(1 << y) or v | 1 << y)
+    end
+    return i == 6 and 16 or 8
+end
+
+-- opcode -> function(s) returning the cycles taken
+local ops = {}
+for opc=0x40,0x7f do
+    local d,r = opc >> 3 & 7,opc & 7
+    ops[opc] = function(s) set(s, d, get(s, r)) return (d == 6 or r == 6) and 8 or 4 end
+end
+ops[0x76] = nil -- halt
+for opc=0x80,0xbf do
+    local f,r = alu[opc >> 3 & 7],opc & 7
+    ops[opc] = function(s) f(s, get(s, r)) return r == 6 and 8 or 4 end
+end
+for y=0,7 do
+    local f = alu[y]
+    ops[0xc6 | y<<3] = function(s) f(s, fetch(s)) return 8 end
+    ops[0x04 | y<<3] = function(s) -- inc r
+        local v = (get(s, y) + 1) & 0xff
+        set(s, y, v)
+        s.f = s.f & C | (v == 0 and Z or 0) | (v & 0xf == 0 and H or 0)
+        return y == 6 and 12 or 4
+    end
+    ops[0x05 | y<<3] = function(s) -- dec r
+        local v = (get(s, y) - 1) & 0xff
+        set(s, y, v)
+        s.f = s.f & C | N | (v == 0 and Z or 0) | (v & 0xf == 0xf and H or 0)
+        return y == 6 and 12 or 4
+    end
+    ops[0x06 | y<<3] = function(s) set(s, y, fetch(s)) return y == 6 and 12 or 8 end
+    ops[0xc7 | y<<3] = function(s) push(s, s.pc) s.pc = y<<3 return 16 end -- rst
+end
+for i=0,3 do
+    ops[0x01 | i<<4] = function(s) setrp(s, i, fetchw(s)) return 12 end
+    ops[0x03 | i<<4] = function(s) setrp(s, i, getrp(s, i) + 1) return 8 end
+    ops[0x0b | i<<4] = function(s) setrp(s, i, getrp(s, i) - 1) return 8 end
+    ops[0x09 | i<<4] = function(s)
+        local a,v = hl(s),getrp(s, i)
+        s.f = s.f & Z | ((a & 0xfff) + (v & 0xfff) > 0xfff and H or 0) | (a + v > 0xffff and C or 0)
+        sethl(s, (a + v) & 0xffff)
+        return 8
+    end
+    ops[0xc1 | i<<4] = function(s) s:pair(rp2[i], pull(s)) return 12 end
+    ops[0xc5 | i<<4] = function(s) push(s, s:pair(rp2[i])) return 16 end
+end
+for i=0,3 do
+    ops[0x20 | i<<3] = function(s) local e = signed(fetch(s)) if not cond(s, i) then return 8 end s.pc = (s.pc + e) & 0xffff return 12 end
+    ops[0xc0 | i<<3] = function(s) if not cond(s, i) then return 8 end s.pc = pull(s) return 20 end
+    ops[0xc2 | i<<3] = function(s) local a = fetchw(s) if not cond(s, i) then return 12 end s.pc = a return 16 end
+    ops[0xc4 | i<<3] = function(s) local a = fetchw(s) if not cond(s, i) then return 12 end push(s, s.pc) s.pc = a return 24 end
+end
+-- indirect loads through bc, de and hl with post increment or decrement
+local ind = { [0]=function(s) return s:pair('bc') end, function(s) return s:pair('de') end,
+    function(s) local a = hl(s) sethl(s, (a+1) & 0xffff) return a end,
+    function(s) local a = hl(s) sethl(s, (a-1) & 0xffff) return a end }
+for i=0,3 do
+    ops[0x02 | i<<4] = function(s) s:write(ind[i](s), s.a) return 8 end
+    ops[0x0a | i<<4] = function(s) s.a = s:read(ind[i](s)) return 8 end
+end
+local rot = function(opc, y)
+    ops[opc] = function(s) local r,c = shift[y](s.a, s.f >> 4 & 1) s.a = r s.f = c == 1 and C or 0 return 4 end
+end
+rot(0x07, 0) rot(0x0f, 1) rot(0x17, 2) rot(0x1f, 3)
+ops[0x00] = function(s) return 4 end
+ops[0x08] = function(s) local a = fetchw(s) s:write(a, s.sp & 0xff) s:write((a+1) & 0xffff, s.sp >> 8) return 20 end
+ops[0x18] = function(s) local e = signed(fetch(s)) s.pc = (s.pc + e) & 0xffff return 12 end
+ops[0x27] = function(s) -- daa
+    local a,f = s.a,s.f
+    if f & N == 0 then
+        if f & C ~= 0 or a > 0x99 then a = a + 0x60 f = f | C end
+        if f & H ~= 0 or a & 0xf > 9 then a = a + 6 end
+    else
+        if f & C ~= 0 then a = a - 0x60 end
+        if f & H ~= 0 then a = a - 6 end
+    end
+    s.a = a & 0xff
+    s.f = f & (N|C) | (s.a == 0 and Z or 0)
+    return 4
+end
+ops[0x2f] = function(s) s.a = ~s.a & 0xff s.f = s.f | N | H return 4 end
+ops[0x37] = function(s) s.f = s.f & Z | C return 4 end
+ops[0x3f] = function(s) s.f = s.f & (Z|C) ~ C return 4 end
+ops[0xc3] = function(s) s.pc = fetchw(s) return 16 end
+ops[0xc9] = function(s) s.pc = pull(s) return 16 end
+ops[0xd9] = function(s) s.pc = pull(s) s.ime = true return 16 end
+ops[0xcb] = cb
+ops[0xcd] = function(s) local a = fetchw(s) push(s, s.pc) s.pc = a return 24 end
+ops[0xe0] = function(s) s:write(0xff00 | fetch(s), s.a) return 12 end
+ops[0xf0] = function(s) s.a = s:read(0xff00 | fetch(s)) return 12 end
+ops[0xe2] = function(s) s:write(0xff00 | s.c, s.a) return 8 end
+ops[0xf2] = function(s) s.a = s:read(0xff00 | s.c) return 8 end
+ops[0xea] = function(s) s:write(fetchw(s), s.a) return 16 end
+ops[0xfa] = function(s) s.a = s:read(fetchw(s)) return 16 end
+local spe = function(s)
+    local e = fetch(s)
+    s.f = ((s.sp & 0xf) + (e & 0xf) > 0xf and H or 0) | ((s.sp & 0xff) + e > 0xff and C or 0)
+    return (s.sp + signed(e)) & 0xffff
+end
+ops[0xe8] = function(s) s.sp = spe(s) return 16 end
+ops[0xf8] = function(s) sethl(s, spe(s)) return 12 end
+ops[0xe9] = function(s) s.pc = hl(s) return 4 end
+ops[0xf9] = function(s) s.sp = hl(s) return 8 end
+ops[0xf3] = function(s) s.ime = false return 4 end
+ops[0xfb] = function(s) s.ime = true return 4 end
+S.ops = ops
+
+-- Execute one instruction, return the cycles it took.
+S.step = function(s)
+    local opc = s:read(s.pc)
+    local op = ops[opc]
+    if not op then error(string.format("unsupported opcode %02x at %04x", opc, s.pc), 0) end
+    s.pc = (s.pc+1) & 0xffff
+    local cycles = op(s)
+    s.cycles = s.cycles + cycles
+    return cycles
+end
+
+-- Call the subroutine at 'address' as call would and run it until it
+-- returns, return the cycles it took, including its ret.
+S.call = function(s, address)
+    local sp0,start = s.sp,s.cycles
+    push(s, 0)
+    s.pc = address
+    repeat
+        s:step()
+        if s.cycles - start > s.limit then
+            error(string.format("subroutine at %04x still running after %d cycles, at %04x", address, s.limit, s.pc), 0)
+        end
+    until s.pc == 0 and s.sp == sp0
+    return s.cycles - start
+end
+
+return S
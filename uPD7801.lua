@@ -25,7 +25,7 @@ local opimp={
 } M.opimp = opimp
 for k,v in pairs(opimp) do
     M[k .. 'imp' ] = function()
-        table.insert(M.section_current.instructions, { size=1, cycles=v.cycles, bin=v.opc })
+        table.insert(M.section_current.instructions, { op=k, size=1, cycles=v.cycles, bin=v.opc })
     end
 end
 
@@ -155,7 +155,7 @@ local opr8r8 ={
 } M.opr8r8 = opr8r8
 for k,v in pairs(opr8r8) do
     M[k] = function()
-        table.insert(M.section_current.instructions, { size=1, cycles=v.cycles, bin=v.opc })
+        table.insert(M.section_current.instructions, { op=k, size=1, cycles=v.cycles, bin=v.opc })
     end
 end
 
@@ -222,64 +222,121 @@ M['calf' .. 'imm'] = function(late, early)
     table.insert(M.section_current.instructions, op)
 end
 
+-- Resolve the branch target 'label' under 'parent' into an address.
+local branch_target = function(label, parent)
+    local x,l = label,label
+    if type(x) == 'function' then x=x() end
+    if type(x) == 'string' then
+        if x:sub(1,1) == '_' then x=parent..x l=x end
+        x = symbols[x]
+    end
+    if type(x) ~= 'number' then error("unresolved branch target: " .. tostring(x)) end
+    return x,l
+end
+
+-- Relative jumps start in their short form: when their target is out of
+-- range within the section, jr grows into jre, and jre into jmp.
+local branch_relax = function(op, label, parent, section)
+    return function()
+        if op.form == 'jmp' then return end
+        local target = M.label_offset(label, parent, section)
+        if not target then return end
+        local x = target - op.offset
+        if op.form == 'jr' and x-1 >= -32 and x-1 <= 31 then return end
+        if op.form == 'jre' and x-2 >= -256 and x-2 <= 255 then return end
+        if op.form == 'jr' and x-2 >= -256 and x-2 <= 255 then
+            op.form,op.size,op.cycles = 'jre',2,17
+        else
+            op.form,op.size,op.cycles = 'jmp',3,opw.jmp.cycles
+        end
+        return true
+    end
+end
+
+local branch_bin = function(op, label, parent, section, rorg)
+    local x,l = branch_target(label, parent)
+    if op.form == 'jmp' then return { opw.jmp.opc, x&0xff, x>>8 } end
+    if op.form == 'jre' then
+        x = x-2 - op.offset - rorg(section.org)
+        if x < -256 or x > 255 then error("branch target out of range for " .. l .. ": " .. x) end
+        local opcode = x >= 0 and 0x4e or 0x4f
+        return { opcode, x&0xff }
+    end
+    x = x-1 - op.offset - rorg(section.org)
+    if x < -32 or x > 31 then error("branch target out of range for " .. l .. ": " .. x)
+    elseif x >= 0 then
+        x = 0xc0 + x
+        return x
+    else
+        return x & 0xff
+    end
+end
+
 M.jr = function(label)
     local l7801dbg = { info=debug.getinfo(2, 'Sl'), trace=debug.traceback(nil, 1) }
-    local parent,offset = M.label_current
+    local parent = M.label_current
     local section,rorg = M.section_current,M.location_current.rorg
-    local op = { cycles=13 }
+    local op = { op='jr', target=label, parent=parent, cycles=13, form='jr' }
     op.size = function()
-        offset = section.size
         label = M.size_dc(label)
         return 1
     end
+    op.relax = branch_relax(op, label, parent, section)
     op.bin = function() 
         local l7801dbg=l7801dbg 
-        local x,l = label,label
-        if type(x) == 'function' then x=x() end
-        if type(x) == 'string' then
-            if x:sub(1,1) == '_' then x=parent..x l=x end
-            x = symbols[x]
-        end
-        if type(x) ~= 'number' then error("unresolved branch target: " .. tostring(x)) end
-        x = x-1 - offset - rorg(section.org)
-        if x < -32 or x > 32 then error("branch target out of range for " .. l .. ": " .. x)
-        elseif x >= 0 then
-            x = 0xc0 + x
-            return x
-        else
-            return x & 0xff
-        end
+        return branch_bin(op, label, parent, section, rorg)
     end
     table.insert(M.section_current.instructions, op)
 end
 
 M.jre = function(label)
     local l7801dbg = { info=debug.getinfo(2, 'Sl'), trace=debug.traceback(nil, 1) }
-    local parent,offset = M.label_current
+    local parent = M.label_current
     local section,rorg = M.section_current,M.location_current.rorg
-    local op = { cycles=17 }
+    local op = { op='jre', target=label, parent=parent, cycles=17, form='jre' }
     op.size = function()
-        offset = section.size
         label = M.size_dc(label)
         return 2
     end
+    op.relax = branch_relax(op, label, parent, section)
     op.bin = function() 
         local l7801dbg=l7801dbg 
-        local x,l = label,label
-        if type(x) == 'function' then x=x() end
-        if type(x) == 'string' then
-            if x:sub(1,1) == '_' then x=parent..x l=x end
-            x = symbols[x]
-        end
-        if type(x) ~= 'number' then error("unresolved branch target: " .. tostring(x)) end
-        x = x-2 - offset - rorg(section.org)
-        if x < -128 or x > 127 then error("branch target out of range for " .. l .. ": " .. x) end
-        local opcode = x >= 0 and 0x4e or 0x4f 
-        return { opcode, x&0xff }
+        return branch_bin(op, label, parent, section, rorg)
     end
     table.insert(M.section_current.instructions, op)
 end
 
+-- peephole rules, see asm.lua peephole()
+local jumps = { jr=1, jre=2 }
+M.peephole_rules = {
+    -- jr or jre to the instruction right after it
+    function(ins, i)
+        local a = ins[i]
+        if not jumps[a.op] then return end
+        local label = M.find_label(a.target, a.parent)
+        if not label then return end
+        for j=i+1,#ins do
+            if ins[j] == label then return i,1,jumps[a.op],a.cycles end
+            if ins[j].type ~= 'label' then return end
+        end
+    end,
+    -- jr or jre to ret
+    function(ins, i)
+        local a = ins[i]
+        if not jumps[a.op] then return end
+        local label = M.find_label(a.target, a.parent)
+        local target = label and M.label_next(label)
+        if not target or target.op ~= 'ret' then return end
+        return i,1,jumps[a.op]-1,a.cycles,{ op='ret', size=1, cycles=target.cycles, bin=target.bin }
+    end,
+    -- mov r1,r2 then mov r2,r1: both already hold the same value
+    function(ins, i, last)
+        local a,b = ins[i].op,i < last and ins[i+1].op
+        if not b or not opr8r8[a] or not opr8r8[b] then return end
+        if a:sub(4,4) == b:sub(5,5) and a:sub(5,5) == b:sub(4,4) then return i+1,1,1,4 end
+    end,
+}
+
 local opwa = {
     inrw=M.op(0x20,13),
     ldaw=M.op(0x28,10),
@@ -11,6 +11,7 @@ local function eval(v)
         local s = M.symbols[v]
         if s ~= nil then v = s end
     end
+    if M.section_sizing then M.size_ref(v) end
     return v
 end
 
@@ -40,32 +41,56 @@ local function wordle(v)
 end
 
 local function emit(size, bin, cycles)
-    table.insert(M.section_current.instructions, {
-        size = function() return size end,
+    local ins = {
+        size = function()
+            -- early evaluation records the sections referenced by the operands
+            if M.strip_unreachable and type(bin) == "function" then M.pcall(bin) end
+            return size
+        end,
         cycles = cycles,
+        -- constant encodings are visible to the peephole rules
+        code = type(bin) == "table" and bin or nil,
         bin = type(bin) == "function" and bin or function() return bin end,
-    })
+    }
+    table.insert(M.section_current.instructions, ins)
+    return ins
 end
 
-local function emit_rel(opc, target, cycles)
-    local parent, offset = M.label_current
+-- 'far' is the opcode of the absolute jump replacing the branch when its
+-- target is out of range within the section; with 'jump', the branch is a
+-- jp shrunk by relax_jumps, which also grows back when its target is in
+-- another section.
+local function emit_rel(opc, target, cycles, far, jump)
+    local parent = M.label_current
     local section, rorg = M.section_current, M.location_current.rorg
-    local ins = { cycles = cycles or 12 }
+    local ins = { cycles = cycles or 12, target = target, parent = parent }
     ins.size = function()
-        offset = section.size
+        M.size_dc(target)
         return 2
     end
+    if far then
+        ins.relax = function()
+            if ins.far then return end
+            local o = M.label_offset(target, parent, section)
+            if o and o - 2 - ins.offset >= -128 and o - 2 - ins.offset <= 127 then return end
+            if not o and not jump then return end
+            ins.far, ins.size, ins.cycles = true, 3, M.gameboy and 16 or 10
+            return true
+        end
+    end
     ins.bin = function()
         local x, label = eval(target), target
         if type(label) == "string" and label:sub(1, 1) == "_" then
             x = parent .. label
         end
         if type(x) == "string" or type(x) == "table" then x = M.op_resolve(x) end
-        x = x - 2 - offset - rorg(section.org)
+        if ins.far then return { far, x & 0xff, (x >> 8) & 0xff } end
+        x = x - 2 - ins.offset - rorg(section.org)
         if x < -128 or x > 127 then die("relative branch out of range: " .. x) end
         return { opc, x & 0xff }
     end
     table.insert(M.section_current.instructions, ins)
+    return ins
 end
 
 function M.imm(v) return { kind = "imm", value = v } end
@@ -210,16 +235,20 @@ function M.ld_auto(a, b)
     a, b = eval(a), eval(b)
     if not M.gameboy then return M.ld(a, b) end
 
+    -- string operands are registers, or ram_var() and ram_local() names placed at link
+    local function direct(o)
+        return is_mem(o) and (type(o.value) ~= "string" or M.ram_vars[o.value] or M.ram_locals[o.value])
+    end
     local address, absolute_opcode, high_opcode
-    if a == "a" and is_mem(b) and type(b.value) ~= "string" then
+    if a == "a" and direct(b) then
         address, absolute_opcode, high_opcode = b.value, 0xfa, 0xf0
-    elseif is_mem(a) and type(a.value) ~= "string" and b == "a" then
+    elseif direct(a) and b == "a" then
         address, absolute_opcode, high_opcode = a.value, 0xea, 0xe0
     else
         return M.ld(a, b)
     end
 
-    local ins = {}
+    local ins = { mode = "ldauto", late = function() return M.op_resolve(address) end }
     ins.size = function()
         local ok, value = M.pcall_za(word, address)
         if not ok then return 3 end
@@ -292,28 +321,42 @@ end
 function M.inc(o) return incdec("inc", o) end
 function M.dec(o) return incdec("dec", o) end
 
+local jr_conditions = { nz = 0x20, z = 0x28, nc = 0x30, c = 0x38 }
+
 function M.jp(a, b)
     a, b = eval(a), eval(b)
     if b then
         local c = condition_code(a)
         if not c then die("invalid jp condition") end
-        return emit(3, function() local lo, hi = wordle(b); return { 0xc2 | (c << 3), lo, hi } end)
+        local ins
+        if M.relax_jumps and jr_conditions[a] and not is_mem(b) then
+            ins = emit_rel(jr_conditions[a], b, 12, 0xc2 | (c << 3), true)
+        else
+            ins = emit(3, function() local lo, hi = wordle(b); return { 0xc2 | (c << 3), lo, hi } end)
+        end
+        ins.op, ins.cond, ins.target, ins.parent = "jp", c, b, M.label_current
+        return
     end
     if is_mem(a) and (a.value == "hl" or a.value == "ix" or a.value == "iy") then
         local p = prefix_for(a.value)
         return emit(p and 2 or 1, p and { p, 0xe9 } or { 0xe9 })
     end
-    emit(3, function() local lo, hi = wordle(a); return { 0xc3, lo, hi } end)
+    local ins
+    if M.relax_jumps then ins = emit_rel(0x18, a, 12, 0xc3, true)
+    else ins = emit(3, function() local lo, hi = wordle(a); return { 0xc3, lo, hi } end) end
+    ins.op, ins.target, ins.parent = "jp", a, M.label_current
 end
 
 function M.jr(a, b)
     a, b = eval(a), eval(b)
     if b then
-        local c = ({ nz = 0x20, z = 0x28, nc = 0x30, c = 0x38 })[a]
+        local c = jr_conditions[a]
         if not c then die("invalid jr condition") end
-        return emit_rel(c, b, 12)
+        local ins = emit_rel(c, b, 12, 0xc2 | (c - 0x20))
+        ins.op, ins.cond = "jr", (c - 0x20) >> 3
+        return
     end
-    emit_rel(0x18, a, 12)
+    emit_rel(0x18, a, 12, 0xc3).op = "jr"
 end
 function M.djnz(a) emit_rel(0x10, a, 13) end
 
@@ -322,9 +365,12 @@ function M.call(a, b)
     if b then
         local c = condition_code(a)
         if not c then die("invalid call condition") end
-        return emit(3, function() local lo, hi = wordle(b); return { 0xc4 | (c << 3), lo, hi } end)
+        local ins = emit(3, function() local lo, hi = wordle(b); return { 0xc4 | (c << 3), lo, hi } end)
+        ins.op, ins.target, ins.parent = "call", b, M.label_current
+        return
     end
-    emit(3, function() local lo, hi = wordle(a); return { 0xcd, lo, hi } end)
+    local ins = emit(3, function() local lo, hi = wordle(a); return { 0xcd, lo, hi } end)
+    ins.op, ins.target, ins.parent = "call", a, M.label_current
 end
 
 function M.ret(c)
@@ -343,9 +389,9 @@ function M.retn()
 end
 function M.rst(n)
     emit(1, function()
-        n = byte(imm_value(eval(n)))
-        if n & 0xc7 ~= 0 or n > 0x38 then die("invalid rst vector") end
-        return { 0xc7 | n }
+        local v = byte(imm_value(eval(n)))
+        if v & 0xc7 ~= 0 or v > 0x38 then die("invalid rst vector") end
+        return { 0xc7 | v }
     end)
 end
 
@@ -353,13 +399,13 @@ function M.push(r)
     r = eval(r)
     local c, p = rp2code(r, true)
     if c == nil then die("unsupported push") end
-    emit(p and 2 or 1, p and { p, 0xc5 | (c << 4) } or { 0xc5 | (c << 4) })
+    emit(p and 2 or 1, p and { p, 0xc5 | (c << 4) } or { 0xc5 | (c << 4) }).op = "push"
 end
 function M.pop(r)
     r = eval(r)
     local c, p = rp2code(r, true)
     if c == nil then die("unsupported pop") end
-    emit(p and 2 or 1, p and { p, 0xc1 | (c << 4) } or { 0xc1 | (c << 4) })
+    emit(p and 2 or 1, p and { p, 0xc1 | (c << 4) } or { 0xc1 | (c << 4) }).op = "pop"
 end
 
 local rotbase = { rlc = 0x00, rrc = 0x08, rl = 0x10, rr = 0x18, sla = 0x20, sra = 0x28, srl = 0x38 }
@@ -479,9 +525,68 @@ function M.ldh(a, b)
     end
     if is_mem(a) and a.value == "c" and b == "a" then return emit(1, { 0xe2 }) end
     if a == "a" and is_mem(b) and b.value == "c" then return emit(1, { 0xf2 }) end
-    if is_mem(a) and b == "a" then return emit(2, function() return { 0xe0, high_byte(a.value) } end) end
-    if a == "a" and is_mem(b) then return emit(2, function() return { 0xf0, high_byte(b.value) } end) end
-    die("unsupported ldh")
-end
+    local ins
+    if is_mem(a) and b == "a" then ins = emit(2, function() return { 0xe0, high_byte(a.value) } end) end
+    if a == "a" and is_mem(b) then ins = emit(2, function() return { 0xf0, high_byte(b.value) } end) end
+    if not ins then die("unsupported ldh") end
+    -- ram_var() operands of ldh must be placed in HRAM
+    local address = is_mem(a) and a.value or b.value
+    ins.mode, ins.late = "ldh", function() return M.op_resolve(address) end
+    return ins
+end
+
+-- call graph of ram_local() and callgraph(): bytes pushed by calls and jumps
+-- to other sections, and by stack instructions
+M.call_ops = { call = 2, jp = 0, jr = 0 }
+M.stack_ops = { push = 2, pop = -2 }
+M.interrupt_stack = 2
+
+-- opcodes after which execution does not continue with the next instruction
+M.opflow = { [0xc3] = true, [0x18] = true, [0xc9] = true, [0xe9] = true }
+
+-- peephole rules, see asm.lua peephole()
+local jump_size = function(ins) return ins.op == "jp" and not ins.relax and 3 or 2 end
+local jump_cycles = function(ins)
+    if ins.op == "jr" or ins.relax then return 12 end
+    return M.gameboy and 16 or 10
+end
+M.peephole_rules = {
+    -- jp or jr to the instruction right after it
+    function(ins, i)
+        local a = ins[i]
+        if a.op ~= "jp" and a.op ~= "jr" then return end
+        local label = M.find_label(a.target, a.parent)
+        if not label then return end
+        for j = i + 1, #ins do
+            if ins[j] == label then return i, 1, jump_size(a), jump_cycles(a) end
+            if ins[j].type ~= "label" then return end
+        end
+    end,
+    -- jp or jr to ret, replaced by a ret on the same condition
+    function(ins, i)
+        local a = ins[i]
+        if a.op ~= "jp" and a.op ~= "jr" then return end
+        local label = M.find_label(a.target, a.parent)
+        local target = label and M.label_next(label)
+        if not target or not target.code or #target.code ~= 1 or target.code[1] ~= 0xc9 then return end
+        local code = { a.cond and 0xc0 | (a.cond << 3) or 0xc9 }
+        return i, 1, jump_size(a) - 1, jump_cycles(a),
+            { size = 1, cycles = target.cycles, code = code, bin = function() return code end }
+    end,
+    -- ld r,r, except ld b,b and ld d,d which emulators use as debug markers
+    function(ins, i)
+        local code = ins[i].code
+        if not code or #code ~= 1 or code[1] & 0xc0 ~= 0x40 then return end
+        local d, s = (code[1] >> 3) & 7, code[1] & 7
+        if d == s and d ~= 6 and d ~= 0 and d ~= 2 then return i, 1, 1, 4 end
+    end,
+    -- ld r1,r2 then ld r2,r1: both already hold the same value
+    function(ins, i, last)
+        local a, b = ins[i].code, i < last and ins[i + 1].code
+        if not a or not b or #a ~= 1 or #b ~= 1 or a[1] & 0xc0 ~= 0x40 or b[1] & 0xc0 ~= 0x40 then return end
+        local d, s = (a[1] >> 3) & 7, a[1] & 7
+        if d ~= 6 and s ~= 6 and d ~= s and b[1] == 0x40 | (s << 3) | d then return i + 1, 1, 1, 4 end
+    end,
+}
 
 return M